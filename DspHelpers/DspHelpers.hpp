@@ -17,6 +17,20 @@
 #include <queue>
 #include <numeric>
 #include <cassert>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <complex>
+#include <fstream>
+#include <string>
+#include <random>
+#include <cstdint>
+#include <limits>
 
 // A simple collection of helpful DSP algorithms with no dependencies.  Many of these algorithms were derived from equations found in "Hack Audio" by Eric Tarr -- please support here https://www.amazon.co.uk/Hack-Audio-Introduction-Programming-Engineering/dp/1138497541
 
@@ -26,6 +40,7 @@ namespace tap
 template <typename Type>
 class Decibels
 {
+public:
     /** Convert raw gain (between 0 - 1) to dBFS */
     static Type convertGainToDecibels (Type rawGain)
     {
@@ -97,6 +112,11 @@ public:
         return rmsVal;
     }
     
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+    
 private:
     Type peakVal;
     Type rmsVal;
@@ -120,6 +140,20 @@ public:
     {
         currentSampleRate = sampleRate;
         timeStep = 1 / currentSampleRate;
+        samplesPerCycle = static_cast<long long> (std::ceil (currentSampleRate));
+        lastFrequency = 0;
+    }
+
+    /** Jump straight to any sample on the timeline, as if process had been called sampleIndex times since the start.
+        Time is counted in whole samples rather than accumulated, so rendering from here matches a render from the
+        start bit for bit, which lets offline renders split the timeline across threads.
+     */
+    void seekTo (const long long newSampleIndex) noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (samplesPerCycle > 0);
+
+        sampleIndex = newSampleIndex % samplesPerCycle;
     }
     
     /**  Generate a sine wave with the equation (2 * pi * frequency * time + phaseOffset).
@@ -132,13 +166,15 @@ public:
         assert (currentSampleRate > 0);
         
         // Reset time once we complete a cycle
-        if (currentTime >= 1.0)
-            currentTime = 0.0;
+        if (sampleIndex >= samplesPerCycle)
+            sampleIndex = 0;
+
+        currentTime = static_cast<Type> (sampleIndex * timeStep);
         
         auto sample = std::sin (2.0 * pi * frequency * currentTime + phaseOffset);
         
         // Need to increment time for the next time this function calls
-        currentTime += timeStep;
+        ++sampleIndex;
         
         return sample;
     }
@@ -153,13 +189,15 @@ public:
         assert (currentSampleRate > 0);
         
         // Reset time once we complete a cycle
-        if (currentTime >= 1.0)
-            currentTime = 0.0;
+        if (sampleIndex >= samplesPerCycle)
+            sampleIndex = 0;
+
+        currentTime = static_cast<Type> (sampleIndex * timeStep);
         
         auto sample = 2.0f * pi * frequency * currentTime + phaseOffset;
         
         // Find the max harmonic frequency
-        auto maxHarmonic = std::floor (currentSampleRate / (2.0f * frequency));
+        auto maxHarmonic = getMaxHarmonic (frequency);
         
         Type sumOfSines = 0.0;
         
@@ -172,7 +210,7 @@ public:
         auto output = 4 / pi * sumOfSines;
         
         // Need to increment time for the next time this function calls
-        currentTime += timeStep;
+        ++sampleIndex;
         
         return output;
     }
@@ -187,13 +225,15 @@ public:
         assert (currentSampleRate > 0);
         
         // Reset time once we complete a cycle
-        if (currentTime >= 1.0)
-            currentTime = 0.0;
+        if (sampleIndex >= samplesPerCycle)
+            sampleIndex = 0;
+
+        currentTime = static_cast<Type> (sampleIndex * timeStep);
         
         auto sample = 2.0f * pi * frequency * currentTime + phaseOffset;
         
         // Find the max harmonic frequency
-        auto maxHarmonic = std::floor (currentSampleRate / (2.0f * frequency));
+        auto maxHarmonic = getMaxHarmonic (frequency);
         
         Type sumOfSines = 0.0;
         
@@ -206,7 +246,7 @@ public:
         auto output = (1 / 2) - (1 / pi) * sumOfSines;
         
         // Need to increment time for the next time this function calls
-        currentTime += timeStep;
+        ++sampleIndex;
         
         return output;
     }
@@ -221,13 +261,15 @@ public:
         assert (currentSampleRate > 0);
         
         // Reset time once we complete a cycle
-        if (currentTime >= 1.0)
-            currentTime = 0.0;
+        if (sampleIndex >= samplesPerCycle)
+            sampleIndex = 0;
+
+        currentTime = static_cast<Type> (sampleIndex * timeStep);
         
         auto sample = 2.0f * pi * frequency * currentTime + phaseOffset;
         
         // Find the max harmonic frequency
-        auto maxHarmonic = std::floor (currentSampleRate / (2.0f * frequency));
+        auto maxHarmonic = getMaxHarmonic (frequency);
         
         Type sumOfSines = 0.0;
         
@@ -240,7 +282,7 @@ public:
         auto output = (8 / (pi * pi)) * sumOfSines;
         
         // Need to increment time for the next time this function calls
-        currentTime += timeStep;
+        ++sampleIndex;
         
         return output;
     }
@@ -255,13 +297,15 @@ public:
         assert (currentSampleRate > 0);
         
         // Reset time once we complete a cycle
-        if (currentTime >= 1.0)
-            currentTime = 0.0;
+        if (sampleIndex >= samplesPerCycle)
+            sampleIndex = 0;
+
+        currentTime = static_cast<Type> (sampleIndex * timeStep);
         
         auto sample = 2.0f * pi * frequency * currentTime + phaseOffset;
         
         // Find the max harmonic frequency
-        auto maxHarmonic = std::floor (currentSampleRate / (2.0f * frequency));
+        auto maxHarmonic = getMaxHarmonic (frequency);
         
         Type sumOfSines = 0.0;
         
@@ -274,16 +318,38 @@ public:
         auto output = (pi / (2 * maxHarmonic)) * sumOfSines;
         
         // Need to increment time for the next time this function calls
-        currentTime += timeStep;
+        ++sampleIndex;
         
         return output;
     }
     
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+    
 private:
     static constexpr Type pi = 3.141592653589793238;
     double currentSampleRate = 0;
     Type currentTime = 0;
     Type timeStep = 0;
+    long long sampleIndex = 0;
+    long long samplesPerCycle = 0;
+
+    // The frequency usually only changes at control rate, so only redo the division when it does
+    Type lastFrequency = 0;
+    double cachedMaxHarmonic = 0;
+
+    double getMaxHarmonic (const Type& frequency) noexcept
+    {
+        if (frequency != lastFrequency)
+        {
+            lastFrequency = frequency;
+            cachedMaxHarmonic = std::floor (currentSampleRate / (2.0f * frequency));
+        }
+
+        return cachedMaxHarmonic;
+    }
 };
 
 // =================================================================
@@ -319,6 +385,12 @@ public:
     {
         waveType = type;
     }
+
+    /** Moves the LFO to any sample on the timeline.  See SynthWave::seekTo() */
+    void seekTo (const long long sampleIndex) noexcept
+    {
+        modulator.seekTo (sampleIndex);
+    }
     
     Type process (Type& sample, float amp)
     {
@@ -334,6 +406,11 @@ public:
         return sample * (amp * getModulator());
     }
     
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+    
 private:
     SynthWave<Type> modulator;
     TremoloWaveType waveType = TremoloWaveType::Sine;
@@ -375,27 +452,61 @@ public:
      */
     
     void buildRamp (const int numSamplesToFade, const FadeType& fadeInOrOut, float curve) noexcept
+    {
+        // Your fade is longer than the ramp buffer!
+        assert (numSamplesToFade <= rampSize);
+
+        fadeType = fadeInOrOut;
+        fadeLength = numSamplesToFade;
+        position = 0;
+        fillRamp (fadeRamp, numSamplesToFade, fadeInOrOut, curve);
+    }
+
+    /** Applies the next step of the ramp.  Once the fade is over, fade ins pass the sample through and fade outs silence it. */
+    Type process (const Type& sample) noexcept
+    {
+        if (position < fadeLength)
+            return sample * fadeRamp[position++];
+
+        return fadeType == FadeType::Out ? Type (0) : sample;
+    }
+
+    /** Jump to any sample on the timeline, counted from the start of the fade */
+    void seekTo (const long long sampleIndex) noexcept
+    {
+        position = static_cast<int> (std::min<long long> (std::max<long long> (sampleIndex, 0), fadeLength));
+    }
+
+    /** Writes the same ramp as buildRamp() into your own buffer, e.g. for precomputed fade tables */
+    static void fillRamp (Type* destination, const int numSamplesToFade, const FadeType& fadeInOrOut, float curve) noexcept
     {
         // Prevent division by 0
         if (curve == 0.0f)
             curve = 0.1f;
-        
-        auto start = fadeType == FadeType::Out ? 1.0f : 0.0f;
-        auto end   = fadeType == FadeType::Out ? 0.0f : 1.0f;
-        
+
+        auto start = fadeInOrOut == FadeType::Out ? 1.0f : 0.0f;
+        auto end   = fadeInOrOut == FadeType::Out ? 0.0f : 1.0f;
+
         // Linear fade
         for (int i = 0; i < numSamplesToFade; ++i)
         {
-            auto x = start + (end - start) * (i / numSamplesToFade);
-            fadeRamp[i] = (std::expf (curve * x) - 1) / (std::expf (curve) - 1);
+            auto x = start + (end - start) * (static_cast<float> (i) / numSamplesToFade);
+            destination[i] = (std::exp (curve * x) - 1) / (std::exp (curve) - 1);
         }
     }
     
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+    
 private:
     // Array to hold ramp values (max buffer size of 8196)
     static constexpr int rampSize = 8192;
-    Type fadeRamp [rampSize] = 0;
+    Type fadeRamp [rampSize] = {};
     FadeType fadeType = FadeType::In;
+    int fadeLength = 0;
+    int position = 0;
     
 };
 
@@ -427,29 +538,38 @@ public:
         
         // Only works for a stereo signal
         assert (numChannels == 2);
-        
+
+        return sample * getGain (panningType, channel, panValue);
+    }
+
+    /** Returns the gain process() would apply to a channel.  The pan value only changes at control rate,
+        so precomputing the gains once and multiplying by them is much cheaper than calling process() per sample.
+     */
+    static Type getGain (const PanningType& type, const int& channel, const Type& panValue)
+    {
         auto value = channel == 0 ? 1.0 - panValue : panValue;
-        
-        switch (panningType)
+
+        switch (type)
         {
-            case PanningType::Linear:
-                return sample * (value);
-                break;
             case PanningType::PowerSineLaw:
-                return sample * (std::sin ((value) * pi / 2.0));
-                break;
+                return std::sin ((value) * pi / 2.0);
             case PanningType::PowerSquareLaw:
-                return sample * (std::sqrt (value));
-                break;
+                return std::sqrt (value);
             case PanningType::ModifiedSineLaw:
-                return sample * (std::pow (value, 0.75));
-                break;
+                return std::pow (value, 0.75);
             case PanningType::ModifiedSquareLaw:
-                return sample * (std::sqrt ((value) * std::sin ((value) * pi / 2.0)));
-                break;
+                return std::sqrt ((value) * std::sin ((value) * pi / 2.0));
+            case PanningType::Linear:
+            default:
+                return value;
         }
     }
     
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+    
 private:
     static constexpr Type pi = 3.141592653589793238;
     PanningType panningType = PanningType::Linear;
@@ -500,6 +620,11 @@ public:
         return channel == 0 ? factor * (leftSample - rightSample)
                             : (2 - factor) * (leftSample + rightSample);
     }
+    
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
 };
 
 /**
@@ -531,6 +656,11 @@ public:
         return std::make_tuple (x, y);
     }
     
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+    
 private:
     static constexpr Type pi = 3.141592653589793238;
 };
@@ -613,14 +743,6050 @@ public:
     
     Type processBitCrush (const Type& sample, const Type& numBits)
     {
-        Type bits = 2.0 / std::pow (2.0, numBits - 1.0);
-        return bits * std::round (sample / bits);
+        return processBitCrushWithStep (sample, getBitCrushStep (numBits));
+    }
+
+    /** The same as processBitCrush(), but with the quantisation step precomputed by getBitCrushStep() */
+    Type processBitCrushWithStep (const Type& sample, const Type& step)
+    {
+        return step * std::round (sample / step);
+    }
+
+    /** Returns the size of one quantisation step for a given bit depth */
+    static Type getBitCrushStep (const Type& numBits)
+    {
+        return 2.0 / std::pow (2.0, numBits - 1.0);
+    }
+    
+    int getLatencySamples() const noexcept
+    {
+        return 0;
     }
     
 private:
     static constexpr Type pi = 3.141592653589793238;
 };
 
+// =================================================================
+
+/**
+    A non-owning view onto a block of planar audio.  It only stores the channel pointers,
+    so it's cheap to copy around and never allocates.
+ */
+
+template <typename Type>
+class AudioBlock
+{
+public:
+    static constexpr int maxChannels = 16;
+
+    AudioBlock() = default;
+
+    AudioBlock (Type* const* channelData, const int numChannelsToUse, const int numSamplesToUse) noexcept
+        : numChannels (numChannelsToUse), numSamples (numSamplesToUse)
+    {
+        // Too many channels for an AudioBlock!
+        assert (numChannels >= 0 && numChannels <= maxChannels);
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+            channels[channel] = channelData[channel];
+    }
+
+    Type* getChannelPointer (const int channel) const noexcept
+    {
+        assert (channel >= 0 && channel < numChannels);
+        return channels[channel];
+    }
+
+    int getNumChannels() const noexcept
+    {
+        return numChannels;
+    }
+
+    int getNumSamples() const noexcept
+    {
+        return numSamples;
+    }
+
+    /** Returns a view onto a range of samples within this block */
+    AudioBlock getSubBlock (const int startSample, const int numSamplesToUse) const noexcept
+    {
+        assert (startSample >= 0 && startSample + numSamplesToUse <= numSamples);
+
+        AudioBlock subBlock;
+        subBlock.numChannels = numChannels;
+        subBlock.numSamples = numSamplesToUse;
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+            subBlock.channels[channel] = channels[channel] + startSample;
+
+        return subBlock;
+    }
+
+    void clear() noexcept
+    {
+        for (auto channel = 0; channel < numChannels; ++channel)
+            std::fill (channels[channel], channels[channel] + numSamples, Type (0));
+    }
+
+    /** Copies as many channels and samples as both blocks have in common */
+    void copyFrom (const AudioBlock& source) noexcept
+    {
+        auto channelsToCopy = std::min (numChannels, source.numChannels);
+        auto samplesToCopy  = std::min (numSamples, source.numSamples);
+
+        for (auto channel = 0; channel < channelsToCopy; ++channel)
+            std::copy (source.channels[channel], source.channels[channel] + samplesToCopy, channels[channel]);
+    }
+
+    /** Adds as many channels and samples as both blocks have in common */
+    void addFrom (const AudioBlock& source) noexcept
+    {
+        auto channelsToAdd = std::min (numChannels, source.numChannels);
+        auto samplesToAdd  = std::min (numSamples, source.numSamples);
+
+        for (auto channel = 0; channel < channelsToAdd; ++channel)
+            for (auto sample = 0; sample < samplesToAdd; ++sample)
+                channels[channel][sample] += source.channels[channel][sample];
+    }
+
+private:
+    Type* channels[maxChannels] = {};
+    int numChannels = 0;
+    int numSamples = 0;
+};
+
+// =================================================================
+
+/**
+    A bounded, lock-free queue of preallocated audio blocks for passing audio between exactly
+    one producer thread and one consumer thread.  Nothing is allocated after prepare(), and a
+    full queue simply refuses new blocks, which is how the producer gets held back.
+ */
+
+template <typename Type>
+class BlockQueue
+{
+public:
+    /** Allocate storage for the queue.  Don't call this while another thread is using the queue! */
+    void prepare (const int numChannelsToUse, const int blockSizeToUse, const int capacityToUse)
+    {
+        // You need at least one slot in the queue
+        assert (capacityToUse > 0);
+
+        // Too many channels for an AudioBlock!
+        assert (numChannelsToUse <= AudioBlock<Type>::maxChannels);
+
+        numChannels = numChannelsToUse;
+        blockSize = blockSizeToUse;
+        capacity = capacityToUse;
+
+        storage.assign (static_cast<size_t> (numChannels * blockSize * capacity), Type (0));
+        slotLengths.assign (static_cast<size_t> (capacity), 0);
+
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        writeCount.store (0);
+        readCount.store (0);
+        finished.store (false);
+    }
+
+    /** Producer side: returns false if the queue is full, otherwise points block at the next free slot */
+    bool startWrite (AudioBlock<Type>& block) noexcept
+    {
+        auto write = writeCount.load (std::memory_order_relaxed);
+
+        if (write - readCount.load (std::memory_order_acquire) >= static_cast<size_t> (capacity))
+            return false;
+
+        block = getSlot (write, blockSize);
+        return true;
+    }
+
+    /** Producer side: publishes the slot returned by startWrite() with the number of valid samples in it */
+    void finishWrite (const int numSamplesWritten) noexcept
+    {
+        assert (numSamplesWritten >= 0 && numSamplesWritten <= blockSize);
+
+        auto write = writeCount.load (std::memory_order_relaxed);
+        slotLengths[write % capacity] = numSamplesWritten;
+        writeCount.store (write + 1, std::memory_order_release);
+    }
+
+    /** Consumer side: returns false if the queue is empty, otherwise points block at the oldest slot */
+    bool startRead (AudioBlock<Type>& block) noexcept
+    {
+        auto read = readCount.load (std::memory_order_relaxed);
+
+        if (read == writeCount.load (std::memory_order_acquire))
+            return false;
+
+        block = getSlot (read, slotLengths[read % capacity]);
+        return true;
+    }
+
+    /** Consumer side: hands the slot returned by startRead() back to the producer */
+    void finishRead() noexcept
+    {
+        readCount.store (readCount.load (std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /** Called by the producer once it won't be writing any more blocks */
+    void markFinished() noexcept
+    {
+        finished.store (true, std::memory_order_release);
+    }
+
+    /** True once the producer has finished and every block has been read */
+    bool isFinishedAndEmpty() const noexcept
+    {
+        return finished.load (std::memory_order_acquire)
+            && readCount.load (std::memory_order_acquire) == writeCount.load (std::memory_order_acquire);
+    }
+
+private:
+    std::vector<Type> storage;
+    std::vector<int> slotLengths;
+    int numChannels = 0;
+    int blockSize = 0;
+    int capacity = 0;
+
+    std::atomic<size_t> writeCount { 0 };
+    std::atomic<size_t> readCount { 0 };
+    std::atomic<bool> finished { false };
+
+    AudioBlock<Type> getSlot (const size_t count, const int numSamples) noexcept
+    {
+        Type* channelPointers[AudioBlock<Type>::maxChannels];
+        auto* slotStart = storage.data() + (count % capacity) * static_cast<size_t> (numChannels * blockSize);
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+            channelPointers[channel] = slotStart + channel * blockSize;
+
+        return AudioBlock<Type> (channelPointers, numChannels, numSamples);
+    }
+};
+
+// =================================================================
+
+/**
+    Renders a file (or any other stream of audio) offline using three threads: one reading blocks,
+    one processing them and one writing them out.  The stages are connected by BlockQueues, so
+    reading and writing overlap with the DSP instead of stalling it.  The reader, processor and
+    writer are plain callbacks, so you can plug in whichever audio file library you like.
+ */
+
+template <typename Type>
+class OfflineRenderPipeline
+{
+public:
+    /** Fills the block with up to block.getNumSamples() samples, returning how many were read.  Return 0 at the end of the stream. */
+    using ReadFunction    = std::function<int (AudioBlock<Type>&)>;
+    using ProcessFunction = std::function<void (AudioBlock<Type>&)>;
+    using WriteFunction   = std::function<void (const AudioBlock<Type>&)>;
+
+    /** Allocate the queues.  A deeper queue soaks up more I/O jitter at the cost of memory. */
+    void prepare (const int numChannelsToUse, const int blockSizeToUse, const int queueDepth = 8)
+    {
+        // You need at least one sample per block!
+        assert (blockSizeToUse > 0);
+
+        numChannels = numChannelsToUse;
+        blockSize = blockSizeToUse;
+
+        inputQueue.prepare (numChannels, blockSize, queueDepth);
+        outputQueue.prepare (numChannels, blockSize, queueDepth);
+    }
+
+    /** Runs the whole render and returns once the last block has been written.  Returns the number of samples rendered. */
+    long long render (const ReadFunction& read, const ProcessFunction& process, const WriteFunction& write)
+    {
+        // You must call prepare() before rendering
+        assert (blockSize > 0);
+
+        inputQueue.reset();
+        outputQueue.reset();
+
+        long long samplesRendered = 0;
+
+        std::thread readThread ([&]
+        {
+            AudioBlock<Type> block;
+
+            for (;;)
+            {
+                waitUntil ([&] { return inputQueue.startWrite (block); });
+
+                auto numRead = read (block);
+
+                if (numRead <= 0)
+                    break;
+
+                inputQueue.finishWrite (std::min (numRead, blockSize));
+                notifyWaiters();
+            }
+
+            inputQueue.markFinished();
+            notifyWaiters();
+        });
+
+        std::thread processThread ([&]
+        {
+            AudioBlock<Type> inputBlock, outputBlock;
+
+            for (;;)
+            {
+                auto hasInput = false;
+                waitUntil ([&] { return (hasInput = inputQueue.startRead (inputBlock)) || inputQueue.isFinishedAndEmpty(); });
+
+                if (! hasInput)
+                    break;
+
+                waitUntil ([&] { return outputQueue.startWrite (outputBlock); });
+
+                auto numSamples = inputBlock.getNumSamples();
+                outputBlock = outputBlock.getSubBlock (0, numSamples);
+                outputBlock.copyFrom (inputBlock);
+                inputQueue.finishRead();
+                notifyWaiters();
+
+                process (outputBlock);
+                outputQueue.finishWrite (numSamples);
+                notifyWaiters();
+            }
+
+            outputQueue.markFinished();
+            notifyWaiters();
+        });
+
+        std::thread writeThread ([&]
+        {
+            AudioBlock<Type> block;
+
+            for (;;)
+            {
+                auto hasOutput = false;
+                waitUntil ([&] { return (hasOutput = outputQueue.startRead (block)) || outputQueue.isFinishedAndEmpty(); });
+
+                if (! hasOutput)
+                    break;
+
+                write (block);
+                samplesRendered += block.getNumSamples();
+                outputQueue.finishRead();
+                notifyWaiters();
+            }
+        });
+
+        readThread.join();
+        processThread.join();
+        writeThread.join();
+
+        return samplesRendered;
+    }
+
+private:
+    BlockQueue<Type> inputQueue;
+    BlockQueue<Type> outputQueue;
+    int numChannels = 0;
+    int blockSize = 0;
+
+    // The queues stay lock-free for the audio itself; this is only used to put a stage to sleep
+    // while its queue is full or empty, instead of spinning on a core the other stages need.
+    std::mutex waitMutex;
+    std::condition_variable waitCondition;
+
+    template <typename Predicate>
+    void waitUntil (Predicate predicate)
+    {
+        std::unique_lock<std::mutex> lock (waitMutex);
+        waitCondition.wait (lock, predicate);
+    }
+
+    void notifyWaiters()
+    {
+        // Taking the lock here means a stage can't miss a wake-up between checking its queue and going to sleep
+        { std::lock_guard<std::mutex> lock (waitMutex); }
+        waitCondition.notify_all();
+    }
+};
+
+// =================================================================
+
+/**
+    Renders many independent jobs at once across a pool of worker threads, with each job
+    running through its own OfflineRenderPipeline.  Each job needs its own reader, processor
+    and writer, since jobs run concurrently.
+ */
+
+template <typename Type>
+class OfflineBatchRenderer
+{
+public:
+    void addJob (typename OfflineRenderPipeline<Type>::ReadFunction read,
+                 typename OfflineRenderPipeline<Type>::ProcessFunction process,
+                 typename OfflineRenderPipeline<Type>::WriteFunction write)
+    {
+        jobs.push_back ({ std::move (read), std::move (process), std::move (write) });
+    }
+
+    /** Renders every job that has been added, then clears the job list.
+        Each worker runs a three-thread pipeline, so a numThreads of 0 uses one worker per three hardware threads.
+     */
+    void run (const int numChannels, const int blockSize, int numThreads = 0)
+    {
+        if (numThreads <= 0)
+            numThreads = static_cast<int> (std::max (1u, std::thread::hardware_concurrency() / 3));
+
+        numThreads = std::min (numThreads, static_cast<int> (jobs.size()));
+
+        std::atomic<size_t> nextJob { 0 };
+        std::vector<std::thread> workers;
+
+        for (auto i = 0; i < numThreads; ++i)
+        {
+            workers.emplace_back ([&]
+            {
+                OfflineRenderPipeline<Type> pipeline;
+                pipeline.prepare (numChannels, blockSize);
+
+                for (auto index = nextJob++; index < jobs.size(); index = nextJob++)
+                    pipeline.render (jobs[index].read, jobs[index].process, jobs[index].write);
+            });
+        }
+
+        for (auto& worker : workers)
+            worker.join();
+
+        jobs.clear();
+    }
+
+private:
+    struct Job
+    {
+        typename OfflineRenderPipeline<Type>::ReadFunction read;
+        typename OfflineRenderPipeline<Type>::ProcessFunction process;
+        typename OfflineRenderPipeline<Type>::WriteFunction write;
+    };
+
+    std::vector<Job> jobs;
+};
+
+// =================================================================
+
+/**
+    Splits a batch of lanes into chunks of batchLaneWidth and hands contiguous ranges of them to
+    worker threads, and the inner loops over a chunk are laid out so the compiler can vectorise them.
+    This starts and joins its threads on every call, so it's for one-off jobs like building presets.
+    Anything that runs every block should use a LaneThreadPool instead.
+ */
+
+static constexpr int batchLaneWidth = 16;
+
+template <typename Function>
+void processLanesInParallel (const int numLanes, int numThreads, Function&& processLaneRange)
+{
+    auto numChunks = (numLanes + batchLaneWidth - 1) / batchLaneWidth;
+    numThreads = std::max (1, std::min (numThreads, numChunks));
+
+    if (numThreads == 1)
+    {
+        processLaneRange (0, numLanes);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    auto chunksPerThread = (numChunks + numThreads - 1) / numThreads;
+
+    for (auto i = 0; i < numThreads; ++i)
+    {
+        auto begin = std::min (numLanes, i * chunksPerThread * batchLaneWidth);
+        auto end   = std::min (numLanes, begin + chunksPerThread * batchLaneWidth);
+
+        if (begin < end)
+            workers.emplace_back ([&processLaneRange, begin, end] { processLaneRange (begin, end); });
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+}
+
+// =================================================================
+
+/**
+    The per-block version of processLanesInParallel.  The worker threads are started once in prepare() and then
+    woken for each call to run(), so a block costs a wake-up instead of creating and joining threads.  The calling
+    thread processes the first range itself, and run() doesn't allocate.
+ */
+
+class LaneThreadPool
+{
+public:
+    ~LaneThreadPool()
+    {
+        stop();
+    }
+
+    /** Starts numThreadsToUse - 1 workers, since the calling thread does its share.  Don't call this on the audio thread! */
+    void prepare (const int numThreadsToUse)
+    {
+        stop();
+
+        numThreads = std::max (1, numThreadsToUse);
+        quit = false;
+
+        for (auto i = 1; i < numThreads; ++i)
+            workers.emplace_back ([this, i] { runWorker (i); });
+    }
+
+    int getNumThreads() const noexcept
+    {
+        return numThreads;
+    }
+
+    /** Splits numLanes into chunks of batchLaneWidth, calls processLaneRange (begin, end) once per thread and returns when they've all finished */
+    template <typename Function>
+    void run (const int numLanes, Function&& processLaneRange)
+    {
+        auto numChunks = (numLanes + batchLaneWidth - 1) / batchLaneWidth;
+        auto threadsToUse = std::max (1, std::min (numThreads, numChunks));
+
+        if (threadsToUse == 1)
+        {
+            processLaneRange (0, numLanes);
+            return;
+        }
+
+        using FunctionType = typename std::remove_reference<Function>::type;
+        auto lanesPerThread = (numChunks + threadsToUse - 1) / threadsToUse * batchLaneWidth;
+
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            job = [] (const void* context, const int begin, const int end) { (*static_cast<FunctionType*> (const_cast<void*> (context))) (begin, end); };
+            jobContext = &processLaneRange;
+            jobLanes = numLanes;
+            jobLanesPerThread = lanesPerThread;
+            jobThreads = threadsToUse;
+            pending = threadsToUse - 1;
+            ++generation;
+        }
+
+        wake.notify_all();
+        processLaneRange (0, std::min (numLanes, lanesPerThread));
+
+        std::unique_lock<std::mutex> lock (mutex);
+        finished.wait (lock, [this] { return pending == 0; });
+    }
+
+private:
+    int numThreads = 1;
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    bool quit = false;
+    unsigned long long generation = 0;
+    int pending = 0;
+
+    // The current job, which only changes under the mutex while every worker is idle
+    void (*job) (const void*, int, int) = nullptr;
+    const void* jobContext = nullptr;
+    int jobLanes = 0, jobLanesPerThread = 0, jobThreads = 0;
+
+    void runWorker (const int index)
+    {
+        auto seenGeneration = 0ull;
+        std::unique_lock<std::mutex> lock (mutex);
+
+        for (;;)
+        {
+            wake.wait (lock, [&] { return quit || generation != seenGeneration; });
+
+            if (quit)
+                return;
+
+            seenGeneration = generation;
+
+            // Threads beyond the ones this job needs sit it out
+            if (index >= jobThreads)
+                continue;
+
+            auto begin = std::min (jobLanes, index * jobLanesPerThread);
+            auto end   = std::min (jobLanes, begin + jobLanesPerThread);
+
+            lock.unlock();
+
+            if (begin < end)
+                job (jobContext, begin, end);
+
+            lock.lock();
+
+            if (--pending == 0)
+                finished.notify_one();
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            quit = true;
+        }
+
+        wake.notify_all();
+
+        for (auto& worker : workers)
+            worker.join();
+
+        workers.clear();
+    }
+};
+
+// =================================================================
+
+/**
+    Many independent sine oscillators stored as a structure of arrays, so one call advances every
+    stream by a block.  Rather than calling std::sin per sample, each lane rotates a (sin, cos) pair
+    by its phase increment, which is just a few multiply-adds and vectorises across lanes.
+
+    Output is frame-major: all of the streams for sample 0, then all of the streams for sample 1, and so on.
+    Threads split the streams at multiples of batchLaneWidth, so they only stay off each other's cache lines
+    in the output if it's 64-byte aligned and numStreams is a multiple of batchLaneWidth.  Otherwise
+    neighbouring threads share a line in every row where their ranges meet.
+ */
+
+template <typename Type>
+class SynthWaveBatch
+{
+public:
+    /** Pass the sample rate to the DSP algorithm, allocate state for every stream and start the worker threads */
+    void prepareToPlay (double& sampleRate, const int numStreamsToUse, const int numThreads = 1)
+    {
+        currentSampleRate = sampleRate;
+        numStreams = numStreamsToUse;
+
+        sinState.assign (static_cast<size_t> (numStreams), Type (0));
+        cosState.assign (static_cast<size_t> (numStreams), Type (1));
+        sinIncrement.assign (static_cast<size_t> (numStreams), Type (0));
+        cosIncrement.assign (static_cast<size_t> (numStreams), Type (1));
+        amplitude.assign (static_cast<size_t> (numStreams), Type (1));
+
+        threads.prepare (numThreads);
+    }
+
+    void setFrequency (const int stream, const Type frequency) noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+        assert (stream >= 0 && stream < numStreams);
+
+        auto increment = 2.0 * pi * frequency / currentSampleRate;
+        sinIncrement[stream] = static_cast<Type> (std::sin (increment));
+        cosIncrement[stream] = static_cast<Type> (std::cos (increment));
+    }
+
+    void setAmplitude (const int stream, const Type amp) noexcept
+    {
+        assert (stream >= 0 && stream < numStreams);
+        amplitude[stream] = amp;
+    }
+
+    /** Restart a stream from phase 0, e.g. when a new sound is triggered on it */
+    void resetPhase (const int stream) noexcept
+    {
+        assert (stream >= 0 && stream < numStreams);
+        sinState[stream] = 0;
+        cosState[stream] = 1;
+    }
+
+    int getNumStreams() const noexcept
+    {
+        return numStreams;
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+    /** Writes numSamples frames of numStreams samples each into output */
+    void processSine (Type* output, const int numSamples)
+    {
+        threads.run (numStreams, [&] (const int begin, const int end)
+        {
+            processSineRange (output, numStreams, numSamples, begin, end);
+        });
+    }
+
+    /** Advances only streams begin to end, writing frames that are stride samples apart.  This is for batch
+        processors that run the modulator inside their own parallel pass rather than as a pass of its own.
+     */
+    void processSineRange (Type* output, const int stride, const int numSamples, const int begin, const int end) noexcept
+    {
+        assert (begin >= 0 && end <= numStreams && stride >= numStreams);
+
+        auto* s  = sinState.data();
+        auto* c  = cosState.data();
+        const auto* si = sinIncrement.data();
+        const auto* ci = cosIncrement.data();
+        const auto* a  = amplitude.data();
+
+        for (auto chunk = begin; chunk < end; chunk += batchLaneWidth)
+        {
+            auto chunkEnd = std::min (end, chunk + batchLaneWidth);
+
+            for (auto sample = 0; sample < numSamples; ++sample)
+            {
+                auto* frame = output + static_cast<size_t> (sample) * stride;
+
+                for (auto lane = chunk; lane < chunkEnd; ++lane)
+                {
+                    frame[lane] = a[lane] * s[lane];
+
+                    auto newSin = s[lane] * ci[lane] + c[lane] * si[lane];
+                    c[lane]     = c[lane] * ci[lane] - s[lane] * si[lane];
+                    s[lane]     = newSin;
+                }
+            }
+
+            // Pull each (sin, cos) pair back onto the unit circle so rounding error can't build up
+            for (auto lane = chunk; lane < chunkEnd; ++lane)
+            {
+                auto gain = Type (1.5) - Type (0.5) * (s[lane] * s[lane] + c[lane] * c[lane]);
+                s[lane] *= gain;
+                c[lane] *= gain;
+            }
+        }
+    }
+
+private:
+    static constexpr double pi = 3.141592653589793238;
+    double currentSampleRate = 0;
+    int numStreams = 0;
+
+    std::vector<Type> sinState, cosState;
+    std::vector<Type> sinIncrement, cosIncrement;
+    std::vector<Type> amplitude;
+
+    LaneThreadPool threads;
+};
+
+// =================================================================
+
+/**
+    The batch version of Tremolo with a sine modulator.  Every stream has its own rate and depth,
+    and the modulators are stored as a structure of arrays like SynthWaveBatch.
+    Works in place on frame-major audio, with the same cache line caveat as SynthWaveBatch.
+
+    Each thread renders its streams' modulators and applies them in a single pass.  The modulator
+    buffer is cache line aligned and its rows are padded to a multiple of batchLaneWidth, so threads
+    never share its cache lines.
+ */
+
+template <typename Type>
+class TremoloBatch
+{
+public:
+    /** Pass the sample rate to the DSP algorithm, allocate state for every stream and start the worker threads */
+    void prepareToPlay (double& sampleRate, const int numStreamsToUse, const int maxBlockSize, const int numThreads = 1)
+    {
+        // The modulator runs inside this class's own threads, so it doesn't need any of its own
+        modulator.prepareToPlay (sampleRate, numStreamsToUse);
+        depth.assign (static_cast<size_t> (numStreamsToUse), Type (0));
+
+        stride = (numStreamsToUse + batchLaneWidth - 1) / batchLaneWidth * batchLaneWidth;
+        maxSamples = maxBlockSize;
+
+        // Allocate a spare cache line so the rows can start on a cache line boundary
+        modulatorFrames.assign (static_cast<size_t> (maxSamples * stride) + cacheLineSize / sizeof (Type), Type (0));
+        auto misalignment = reinterpret_cast<std::uintptr_t> (modulatorFrames.data()) % cacheLineSize;
+        modulatorStart = misalignment == 0 ? 0 : (cacheLineSize - misalignment) / sizeof (Type);
+
+        threads.prepare (numThreads);
+    }
+
+    void setFrequency (const int stream, const Type freq) noexcept
+    {
+        modulator.setFrequency (stream, freq);
+    }
+
+    void setDepth (const int stream, const Type amp) noexcept
+    {
+        // Careful!  Your tremolo amp should be between 0.0 and 1.0
+        assert (amp >= 0.0f && amp <= 1.0f);
+        depth[stream] = amp;
+    }
+
+    void process (Type* frames, const int numSamples)
+    {
+        // Your block is bigger than the maxBlockSize you passed to prepareToPlay
+        assert (numSamples <= maxSamples);
+
+        auto numStreams = modulator.getNumStreams();
+
+        threads.run (numStreams, [&] (const int begin, const int end)
+        {
+            auto* modulatorRows = modulatorFrames.data() + modulatorStart;
+            modulator.processSineRange (modulatorRows, stride, numSamples, begin, end);
+
+            for (auto sample = 0; sample < numSamples; ++sample)
+            {
+                auto* frame = frames + static_cast<size_t> (sample) * numStreams;
+                const auto* mod = modulatorRows + static_cast<size_t> (sample) * stride;
+
+                for (auto lane = begin; lane < end; ++lane)
+                    frame[lane] *= depth[lane] * std::abs (mod[lane]);
+            }
+        });
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    static constexpr size_t cacheLineSize = 64;
+
+    SynthWaveBatch<Type> modulator;
+    std::vector<Type> depth;
+    std::vector<Type> modulatorFrames;
+    size_t modulatorStart = 0;
+    int stride = 0;
+    int maxSamples = 0;
+
+    LaneThreadPool threads;
+};
+
+// =================================================================
+
+/** An AudioBlock that owns its own planar storage */
+template <typename Type>
+class AudioBuffer
+{
+public:
+    /** Allocates (and clears) storage.  Don't call this on the audio thread! */
+    void setSize (const int numChannelsToUse, const int numSamplesToUse)
+    {
+        // Too many channels for an AudioBlock!
+        assert (numChannelsToUse <= AudioBlock<Type>::maxChannels);
+
+        numChannels = numChannelsToUse;
+        numSamples = numSamplesToUse;
+        storage.assign (static_cast<size_t> (numChannels * numSamples), Type (0));
+    }
+
+    /** Returns a view onto the first numSamplesToUse samples of every channel */
+    AudioBlock<Type> getBlock (const int numSamplesToUse) noexcept
+    {
+        assert (numSamplesToUse <= numSamples);
+
+        Type* channelPointers[AudioBlock<Type>::maxChannels];
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+            channelPointers[channel] = storage.data() + channel * numSamples;
+
+        return AudioBlock<Type> (channelPointers, numChannels, numSamplesToUse);
+    }
+
+    AudioBlock<Type> getBlock() noexcept
+    {
+        return getBlock (numSamples);
+    }
+
+    int getNumChannels() const noexcept
+    {
+        return numChannels;
+    }
+
+    int getNumSamples() const noexcept
+    {
+        return numSamples;
+    }
+
+private:
+    std::vector<Type> storage;
+    int numChannels = 0;
+    int numSamples = 0;
+};
+
+// =================================================================
+
+/** Everything a BlockProcessor needs to know before it starts processing */
+struct ProcessSpec
+{
+    double sampleRate = 0;
+    int maximumBlockSize = 0;
+    int numChannels = 0;
+};
+
+/**
+    The base class for anything that processes whole AudioBlocks, so processors can be put into
+    ProcessorChains and ParallelProcessors.  prepare() may allocate, process() must not.
+ */
+
+template <typename Type>
+class BlockProcessor
+{
+public:
+    virtual ~BlockProcessor() = default;
+
+    virtual void prepare (const ProcessSpec& spec) = 0;
+    virtual void process (AudioBlock<Type>& block) = 0;
+    virtual void reset() {}
+
+    /** The number of samples this processor delays its output by.  Anything with lookahead, oversampling
+        or an FFT must report it here, so that chains can keep parallel paths lined up.
+     */
+    virtual int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+};
+
+// =================================================================
+
+/** Runs a list of BlockProcessors one after another.  Its latency is the sum of theirs. */
+template <typename Type>
+class ProcessorChain : public BlockProcessor<Type>
+{
+public:
+    /** Add a processor to the end of the chain.  Do this before prepare(), not while processing. */
+    void addProcessor (std::unique_ptr<BlockProcessor<Type>> processor)
+    {
+        processors.push_back (std::move (processor));
+    }
+
+    int getNumProcessors() const noexcept
+    {
+        return static_cast<int> (processors.size());
+    }
+
+    BlockProcessor<Type>* getProcessor (const int index) const noexcept
+    {
+        return processors[static_cast<size_t> (index)].get();
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        for (auto& processor : processors)
+            processor->prepare (spec);
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        for (auto& processor : processors)
+            processor->process (block);
+    }
+
+    void reset() override
+    {
+        for (auto& processor : processors)
+            processor->reset();
+    }
+
+    int getLatencySamples() const noexcept override
+    {
+        auto latency = 0;
+
+        for (auto& processor : processors)
+            latency += processor->getLatencySamples();
+
+        return latency;
+    }
+
+private:
+    std::vector<std::unique_ptr<BlockProcessor<Type>>> processors;
+};
+
+// =================================================================
+
+/** A fixed, whole-sample delay on every channel of a block.  The buffer is a power of two so wrapping is just a mask. */
+template <typename Type>
+class DelayLine : public BlockProcessor<Type>
+{
+public:
+    /** Set the delay in samples.  Takes effect on the next prepare(). */
+    void setDelay (const int numSamples) noexcept
+    {
+        assert (numSamples >= 0);
+        delaySamples = numSamples;
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        auto size = 1;
+
+        while (size < delaySamples + 1)
+            size <<= 1;
+
+        mask = size - 1;
+        buffer.setSize (spec.numChannels, size);
+        writeIndex = 0;
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        if (delaySamples == 0)
+            return;
+
+        auto history = buffer.getBlock();
+        auto numChannels = std::min (block.getNumChannels(), history.getNumChannels());
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+        {
+            auto* data = block.getChannelPointer (channel);
+            auto* line = history.getChannelPointer (channel);
+            auto index = writeIndex;
+
+            for (auto sample = 0; sample < block.getNumSamples(); ++sample)
+            {
+                line[index] = data[sample];
+                data[sample] = line[(index - delaySamples) & mask];
+                index = (index + 1) & mask;
+            }
+        }
+
+        writeIndex = (writeIndex + block.getNumSamples()) & mask;
+    }
+
+    void reset() override
+    {
+        buffer.getBlock().clear();
+    }
+
+    int getLatencySamples() const noexcept override
+    {
+        return delaySamples;
+    }
+
+private:
+    AudioBuffer<Type> buffer;
+    int delaySamples = 0;
+    int writeIndex = 0;
+    int mask = 0;
+};
+
+// =================================================================
+
+/**
+    Feeds the same input through several branches and sums their outputs.  When the branches report
+    different latencies, prepare() adds a compensation delay to every branch that is ahead of the
+    slowest one, so the paths stay lined up.  If a branch's latency changes, prepare() it again.
+ */
+
+template <typename Type>
+class ParallelProcessor : public BlockProcessor<Type>
+{
+public:
+    /** Add a branch.  Do this before prepare(), not while processing. */
+    void addBranch (std::unique_ptr<BlockProcessor<Type>> processor)
+    {
+        branches.push_back ({ std::move (processor), {}, {} });
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        latency = 0;
+
+        for (auto& branch : branches)
+        {
+            branch.processor->prepare (spec);
+            latency = std::max (latency, branch.processor->getLatencySamples());
+        }
+
+        for (auto& branch : branches)
+        {
+            branch.compensation.setDelay (latency - branch.processor->getLatencySamples());
+            branch.compensation.prepare (spec);
+            branch.buffer.setSize (spec.numChannels, spec.maximumBlockSize);
+        }
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        for (auto& branch : branches)
+        {
+            auto branchBlock = branch.buffer.getBlock (block.getNumSamples());
+            branchBlock.copyFrom (block);
+            branch.processor->process (branchBlock);
+            branch.compensation.process (branchBlock);
+        }
+
+        block.clear();
+
+        for (auto& branch : branches)
+            block.addFrom (branch.buffer.getBlock (block.getNumSamples()));
+    }
+
+    void reset() override
+    {
+        for (auto& branch : branches)
+        {
+            branch.processor->reset();
+            branch.compensation.reset();
+        }
+    }
+
+    int getLatencySamples() const noexcept override
+    {
+        return latency;
+    }
+
+private:
+    struct Branch
+    {
+        std::unique_ptr<BlockProcessor<Type>> processor;
+        DelayLine<Type> compensation;
+        AudioBuffer<Type> buffer;
+    };
+
+    std::vector<Branch> branches;
+    int latency = 0;
+};
+
+// =================================================================
+
+/**
+    Takes objects that the audio thread has finished with and deletes them on a background thread,
+    so the audio thread never has to free memory.  Only one thread may call retire().
+ */
+
+template <typename ObjectType>
+class DeferredDeleter
+{
+public:
+    DeferredDeleter()
+        : deleteThread ([this] { run(); })
+    {
+    }
+
+    ~DeferredDeleter()
+    {
+        running.store (false);
+        deleteThread.join();
+        deletePending();
+    }
+
+    /** Hands an object over to be deleted.  Returns false if the queue is full, in which case try again later. */
+    bool retire (ObjectType* object) noexcept
+    {
+        auto write = writeCount.load (std::memory_order_relaxed);
+
+        if (write - readCount.load (std::memory_order_acquire) >= capacity)
+            return false;
+
+        objects[write % capacity] = object;
+        writeCount.store (write + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    static constexpr size_t capacity = 64;
+    ObjectType* objects[capacity] = {};
+    std::atomic<size_t> writeCount { 0 };
+    std::atomic<size_t> readCount { 0 };
+    std::atomic<bool> running { true };
+    std::thread deleteThread;
+
+    void run()
+    {
+        while (running.load())
+        {
+            deletePending();
+            std::this_thread::sleep_for (std::chrono::milliseconds (20));
+        }
+    }
+
+    void deletePending()
+    {
+        auto read = readCount.load (std::memory_order_relaxed);
+
+        while (read != writeCount.load (std::memory_order_acquire))
+        {
+            delete objects[read % capacity];
+            readCount.store (++read, std::memory_order_release);
+        }
+    }
+};
+
+// =================================================================
+
+/**
+    Lets you replace a running processor (a whole chain, a new preset, a different TremoloWaveType...)
+    from the message thread without ever locking the audio thread.
+
+    setProcessor() prepares the new processor on the calling thread and publishes it with an atomic
+    pointer swap.  The audio thread picks it up at the start of its next block, crossfades from the
+    old processor to the new one over that block, then hands the old one to a DeferredDeleter.
+ */
+
+template <typename Type>
+class HotSwapProcessor : public BlockProcessor<Type>
+{
+public:
+    ~HotSwapProcessor() override
+    {
+        delete pending.exchange (nullptr);
+        delete current;
+        delete retiring;
+    }
+
+    /** Call from the message thread.  Until the first processor arrives, audio passes straight through. */
+    void setProcessor (std::unique_ptr<BlockProcessor<Type>> newProcessor)
+    {
+        // You must call prepare() before swapping in processors, so they can be prepared off the audio thread
+        assert (currentSpec.maximumBlockSize > 0);
+        assert (newProcessor != nullptr);
+
+        newProcessor->prepare (currentSpec);
+
+        // Anything still pending was never seen by the audio thread, so it's safe to delete here
+        delete pending.exchange (newProcessor.release(), std::memory_order_acq_rel);
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        currentSpec = spec;
+        fadeBuffer.setSize (spec.numChannels, spec.maximumBlockSize);
+
+        if (current != nullptr)
+            current->prepare (spec);
+
+        if (auto* next = pending.load())
+            next->prepare (spec);
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        if (retiring != nullptr && deleter.retire (retiring))
+            retiring = nullptr;
+
+        // Only take a new processor once the last old one has been handed over
+        auto* next = retiring == nullptr ? pending.exchange (nullptr, std::memory_order_acq_rel) : nullptr;
+
+        if (next == nullptr)
+        {
+            if (current != nullptr)
+                current->process (block);
+
+            return;
+        }
+
+        auto fadeBlock = fadeBuffer.getBlock (block.getNumSamples());
+        fadeBlock.copyFrom (block);
+
+        if (current != nullptr)
+            current->process (fadeBlock);
+
+        next->process (block);
+
+        auto numSamples = block.getNumSamples();
+
+        for (auto channel = 0; channel < block.getNumChannels(); ++channel)
+        {
+            auto* newData = block.getChannelPointer (channel);
+            const auto* oldData = fadeBlock.getChannelPointer (channel);
+
+            for (auto sample = 0; sample < numSamples; ++sample)
+            {
+                auto gain = static_cast<Type> (sample + 1) / static_cast<Type> (numSamples);
+                newData[sample] = oldData[sample] + gain * (newData[sample] - oldData[sample]);
+            }
+        }
+
+        retiring = current;
+        current = next;
+        latency.store (current->getLatencySamples());
+
+        if (retiring != nullptr && deleter.retire (retiring))
+            retiring = nullptr;
+    }
+
+    void reset() override
+    {
+        if (current != nullptr)
+            current->reset();
+    }
+
+    int getLatencySamples() const noexcept override
+    {
+        return latency.load();
+    }
+
+private:
+    ProcessSpec currentSpec;
+    AudioBuffer<Type> fadeBuffer;
+
+    std::atomic<BlockProcessor<Type>*> pending { nullptr };
+    BlockProcessor<Type>* current = nullptr;
+    BlockProcessor<Type>* retiring = nullptr;
+    std::atomic<int> latency { 0 };
+
+    DeferredDeleter<BlockProcessor<Type>> deleter;
+};
+
+// =================================================================
+
+/** Biquad filter coefficients, normalised so that a0 is 1 */
+template <typename Type>
+struct BiquadCoefficients
+{
+    Type b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+
+    /** A 12 dB/octave low pass, from the RBJ Audio EQ Cookbook */
+    static BiquadCoefficients makeLowPass (const double sampleRate, const Type cutoff, const Type q)
+    {
+        // You need a valid sample rate, and the cutoff must be below Nyquist
+        assert (sampleRate > 0 && cutoff > 0 && cutoff < sampleRate / 2);
+
+        auto omega = 2.0 * 3.141592653589793238 * cutoff / sampleRate;
+        auto alpha = std::sin (omega) / (2.0 * q);
+        auto cosOmega = std::cos (omega);
+        auto a0 = 1.0 + alpha;
+
+        BiquadCoefficients coefficients;
+        coefficients.b0 = static_cast<Type> ((1.0 - cosOmega) / 2.0 / a0);
+        coefficients.b1 = static_cast<Type> ((1.0 - cosOmega) / a0);
+        coefficients.b2 = coefficients.b0;
+        coefficients.a1 = static_cast<Type> (-2.0 * cosOmega / a0);
+        coefficients.a2 = static_cast<Type> ((1.0 - alpha) / a0);
+        return coefficients;
+    }
+};
+
+/** The user-facing parameters of a preset, which a ChainSnapshot turns into coefficients */
+template <typename Type>
+struct ChainParameters
+{
+    Type panValue = 0.5;
+    PanningType panningType = PanningType::Linear;
+    Type bitCrushBits = 16;
+    int fadeLength = 0;
+    FadeType fadeType = FadeType::In;
+    float fadeCurve = 1.0f;
+    Type oscillatorFrequency = 440;
+    Type filterCutoff = 1000;
+    Type filterQ = 0.7071;
+};
+
+// =================================================================
+
+/**
+    An immutable set of every coefficient derived from a ChainParameters: pan gains, the bitcrush step,
+    the fade table, the oscillator's phase increment and the filter coefficients.  Build these off the
+    audio thread, and the audio thread only ever has to read them.
+ */
+
+template <typename Type>
+class ChainSnapshot
+{
+public:
+    ChainSnapshot (const ChainParameters<Type>& parameters, const double sampleRate)
+        : panGains { Panner<Type>::getGain (parameters.panningType, 0, parameters.panValue),
+                     Panner<Type>::getGain (parameters.panningType, 1, parameters.panValue) },
+          bitCrushStep (Distortion<Type>::getBitCrushStep (parameters.bitCrushBits)),
+          fadeTable (static_cast<size_t> (parameters.fadeLength)),
+          phaseIncrement (static_cast<Type> (2.0 * 3.141592653589793238 * parameters.oscillatorFrequency / sampleRate)),
+          filterCoefficients (BiquadCoefficients<Type>::makeLowPass (sampleRate, parameters.filterCutoff, parameters.filterQ))
+    {
+        AmplitudeFade<Type>::fillRamp (fadeTable.data(), parameters.fadeLength, parameters.fadeType, parameters.fadeCurve);
+    }
+
+    /** The stereo gain for channel 0 (left) or 1 (right) */
+    Type getPanGain (const int channel) const noexcept
+    {
+        assert (channel >= 0 && channel <= 1);
+        return panGains[channel];
+    }
+
+    Type getBitCrushStep() const noexcept
+    {
+        return bitCrushStep;
+    }
+
+    const std::vector<Type>& getFadeTable() const noexcept
+    {
+        return fadeTable;
+    }
+
+    /** The oscillator's phase increment in radians per sample */
+    Type getPhaseIncrement() const noexcept
+    {
+        return phaseIncrement;
+    }
+
+    const BiquadCoefficients<Type>& getFilterCoefficients() const noexcept
+    {
+        return filterCoefficients;
+    }
+
+private:
+    Type panGains[2];
+    Type bitCrushStep;
+    std::vector<Type> fadeTable;
+    Type phaseIncrement;
+    BiquadCoefficients<Type> filterCoefficients;
+};
+
+// =================================================================
+
+/**
+    Owns a set of ChainSnapshots and lets the audio thread switch between them in O(1).
+
+    Add and recall snapshots from the message thread only.  recall() is a single atomic pointer store,
+    and the audio thread picks up the new snapshot with getActive().  Snapshots are never deleted while
+    the bank is alive, so the audio thread can never be left holding a dangling pointer.
+ */
+
+template <typename Type>
+class SnapshotBank
+{
+public:
+    /** Build a snapshot and store it.  Returns the index to recall it with. */
+    int addSnapshot (const ChainParameters<Type>& parameters, const double sampleRate)
+    {
+        snapshots.push_back (std::make_unique<const ChainSnapshot<Type>> (parameters, sampleRate));
+        return static_cast<int> (snapshots.size()) - 1;
+    }
+
+    /** Build a whole set of presets at once, spread across worker threads.  Returns the index of the first new snapshot. */
+    int addSnapshots (const std::vector<ChainParameters<Type>>& presets, const double sampleRate, const int numThreads = 1)
+    {
+        auto firstIndex = snapshots.size();
+        snapshots.resize (firstIndex + presets.size());
+
+        processLanesInParallel (static_cast<int> (presets.size()), numThreads, [&] (const int begin, const int end)
+        {
+            for (auto i = begin; i < end; ++i)
+                snapshots[firstIndex + static_cast<size_t> (i)] = std::make_unique<const ChainSnapshot<Type>> (presets[static_cast<size_t> (i)], sampleRate);
+        });
+
+        return static_cast<int> (firstIndex);
+    }
+
+    int getNumSnapshots() const noexcept
+    {
+        return static_cast<int> (snapshots.size());
+    }
+
+    /** Make a snapshot the active one */
+    void recall (const int index) noexcept
+    {
+        assert (index >= 0 && index < getNumSnapshots());
+        active.store (snapshots[static_cast<size_t> (index)].get(), std::memory_order_release);
+    }
+
+    /** Call this from the audio thread, once per block.  Returns nullptr until something has been recalled. */
+    const ChainSnapshot<Type>* getActive() const noexcept
+    {
+        return active.load (std::memory_order_acquire);
+    }
+
+private:
+    std::vector<std::unique_ptr<const ChainSnapshot<Type>>> snapshots;
+    std::atomic<const ChainSnapshot<Type>*> active { nullptr };
+};
+
+// =================================================================
+
+/**
+    Ramps linearly towards a target value over a set number of samples.  Compute the expensive target
+    at control rate, and getNextValue() costs one addition per sample.
+ */
+
+template <typename Type>
+class SmoothedValue
+{
+public:
+    /** Jump straight to a value with no ramp */
+    void setCurrentAndTargetValue (const Type value) noexcept
+    {
+        currentValue = targetValue = value;
+        stepsRemaining = 0;
+    }
+
+    /** Start ramping from wherever we are now to a new value over numSteps samples */
+    void setTargetValue (const Type value, const int numSteps) noexcept
+    {
+        targetValue = value;
+
+        if (numSteps <= 0)
+        {
+            setCurrentAndTargetValue (value);
+            return;
+        }
+
+        stepsRemaining = numSteps;
+        increment = (targetValue - currentValue) / static_cast<Type> (numSteps);
+    }
+
+    Type getNextValue() noexcept
+    {
+        if (stepsRemaining <= 0)
+            return currentValue;
+
+        --stepsRemaining;
+        currentValue = stepsRemaining == 0 ? targetValue : currentValue + increment;
+        return currentValue;
+    }
+
+    bool isSmoothing() const noexcept
+    {
+        return stepsRemaining > 0;
+    }
+
+    Type getTargetValue() const noexcept
+    {
+        return targetValue;
+    }
+
+private:
+    Type currentValue = 0;
+    Type targetValue = 0;
+    Type increment = 0;
+    int stepsRemaining = 0;
+};
+
+// =================================================================
+
+/**
+    Splits audio processing into control-rate and audio-rate work.  Processors register callbacks that
+    run every N samples (or once per block) to compute coefficients such as Panner gains, Decibels
+    conversions or a modulator value.  process() then renders audio in the stretches between those
+    updates, so audio-rate code only has to read or interpolate the coefficients.
+
+        scheduler.addCallback ([&] (int numSamplesUntilNext)
+        {
+            leftGain.setTargetValue (tap::Panner<float>::getGain (type, 0, pan.load()), numSamplesUntilNext);
+        }, 32);
+
+        scheduler.process (numSamples, [&] (int startSample, int numSamplesToRender) { ... });
+
+    Add callbacks before processing starts.  Only process() is safe to call on the audio thread.
+ */
+
+class ControlRateScheduler
+{
+public:
+    /** Called with the number of samples until the callback runs again, which is handy for ramp lengths */
+    using Callback = std::function<void (int numSamplesUntilNextUpdate)>;
+
+    /** Register a control-rate callback.  An interval of 0 means once at the start of every block. */
+    void addCallback (Callback callback, const int intervalInSamples)
+    {
+        assert (intervalInSamples >= 0);
+        callbacks.push_back ({ std::move (callback), intervalInSamples, 0 });
+    }
+
+    /** Make every callback run again at the start of the next block */
+    void reset() noexcept
+    {
+        for (auto& entry : callbacks)
+            entry.samplesUntilNextUpdate = 0;
+    }
+
+    /** Runs the due callbacks at each control-rate boundary in the block, and renderAudio (startSample, numSamples) in between */
+    template <typename AudioFunction>
+    void process (const int numSamples, AudioFunction&& renderAudio)
+    {
+        for (auto& entry : callbacks)
+            if (entry.interval == 0)
+                entry.callback (numSamples);
+
+        auto position = 0;
+
+        while (position < numSamples)
+        {
+            auto numToRender = numSamples - position;
+
+            for (auto& entry : callbacks)
+            {
+                if (entry.interval == 0)
+                    continue;
+
+                if (entry.samplesUntilNextUpdate == 0)
+                {
+                    entry.callback (entry.interval);
+                    entry.samplesUntilNextUpdate = entry.interval;
+                }
+
+                numToRender = std::min (numToRender, entry.samplesUntilNextUpdate);
+            }
+
+            renderAudio (position, numToRender);
+
+            for (auto& entry : callbacks)
+                if (entry.interval > 0)
+                    entry.samplesUntilNextUpdate -= numToRender;
+
+            position += numToRender;
+        }
+    }
+
+private:
+    struct Entry
+    {
+        Callback callback;
+        int interval;
+        int samplesUntilNextUpdate;
+    };
+
+    std::vector<Entry> callbacks;
+};
+
+// =================================================================
+
+/**
+    A block-based modulation matrix.  Every source (an LFO built on SynthWave, an envelope, an Amplitude
+    follower, MIDI...) is rendered exactly once per block into its own buffer, however many destinations
+    use it.  Each destination buffer is then the sum of its routes, scaled by their amounts:
+
+        auto lfo   = matrix.addSource ([&] (float* out, int n) { for (int i = 0; i < n; ++i) out[i] = wave.processSine (2.0f); });
+        auto depth = matrix.addDestination();
+        matrix.addRoute (lfo, depth, 0.5f);
+        matrix.prepare (maxBlockSize);
+
+        matrix.process (numSamples);
+        const float* depthModulation = matrix.getDestination (depth);
+
+    Add sources, destinations and routes before prepare().  Route amounts can be changed between blocks.
+ */
+
+template <typename Type>
+class ModulationMatrix
+{
+public:
+    /** Writes numSamples of modulation into destination */
+    using SourceFunction = std::function<void (Type* destination, int numSamples)>;
+
+    int addSource (SourceFunction render)
+    {
+        sources.push_back (std::move (render));
+        return static_cast<int> (sources.size()) - 1;
+    }
+
+    int addDestination()
+    {
+        return numDestinations++;
+    }
+
+    /** Connect a source to a destination.  Returns the route's index, for setRouteAmount(). */
+    int addRoute (const int source, const int destination, const Type amount)
+    {
+        assert (source >= 0 && source < static_cast<int> (sources.size()));
+        assert (destination >= 0 && destination < numDestinations);
+
+        routes.push_back ({ source, destination, amount });
+        return static_cast<int> (routes.size()) - 1;
+    }
+
+    void setRouteAmount (const int route, const Type amount) noexcept
+    {
+        routes[static_cast<size_t> (route)].amount = amount;
+    }
+
+    /** Allocates the shared source and destination buffers */
+    void prepare (const int maxBlockSizeToUse)
+    {
+        maxBlockSize = maxBlockSizeToUse;
+        sourceBuffers.assign (sources.size() * static_cast<size_t> (maxBlockSize), Type (0));
+        destinationBuffers.assign (static_cast<size_t> (numDestinations * maxBlockSize), Type (0));
+    }
+
+    void process (const int numSamples)
+    {
+        // Your block is bigger than the size passed to prepare()
+        assert (numSamples <= maxBlockSize);
+
+        for (size_t source = 0; source < sources.size(); ++source)
+            sources[source] (getSourceBuffer (static_cast<int> (source)), numSamples);
+
+        for (auto destination = 0; destination < numDestinations; ++destination)
+            std::fill (getDestinationBuffer (destination), getDestinationBuffer (destination) + numSamples, Type (0));
+
+        for (const auto& route : routes)
+        {
+            if (route.amount == 0)
+                continue;
+
+            const auto* input = getSourceBuffer (route.source);
+            auto* output = getDestinationBuffer (route.destination);
+            auto amount = route.amount;
+
+            for (auto sample = 0; sample < numSamples; ++sample)
+                output[sample] += amount * input[sample];
+        }
+    }
+
+    /** The summed modulation for a destination, valid until the next call to process() */
+    const Type* getDestination (const int destination) const noexcept
+    {
+        assert (destination >= 0 && destination < numDestinations);
+        return destinationBuffers.data() + destination * maxBlockSize;
+    }
+
+    /** A source's own output, for anything that wants the raw modulation */
+    const Type* getSource (const int source) const noexcept
+    {
+        assert (source >= 0 && source < static_cast<int> (sources.size()));
+        return sourceBuffers.data() + source * maxBlockSize;
+    }
+
+private:
+    struct Route
+    {
+        int source;
+        int destination;
+        Type amount;
+    };
+
+    std::vector<SourceFunction> sources;
+    std::vector<Route> routes;
+    int numDestinations = 0;
+    int maxBlockSize = 0;
+
+    std::vector<Type> sourceBuffers;
+    std::vector<Type> destinationBuffers;
+
+    Type* getSourceBuffer (const int source) noexcept
+    {
+        return sourceBuffers.data() + source * maxBlockSize;
+    }
+
+    Type* getDestinationBuffer (const int destination) noexcept
+    {
+        return destinationBuffers.data() + destination * maxBlockSize;
+    }
+};
+
+// =================================================================
+
+enum class EnvelopeStage
+{
+    Idle,
+    Attack,
+    Decay,
+    Sustain,
+    Release
+};
+
+/**
+    An ADSR envelope that renders whole blocks at a time.  The exponential segments use the recurrence
+    value = base + value * coefficient, which is a single multiply-add per sample instead of a call to std::exp.
+    Each segment aims slightly past its end point (the "target ratio") so it reaches it in a finite time,
+    and the number of samples until it gets there is worked out once per segment rather than checked every sample.
+
+    noteOn() and noteOff() take a sample offset into the next rendered block, so retriggers are sample accurate.
+ */
+
+template <typename Type>
+class Envelope
+{
+public:
+    /** Pass the sample rate to the DSP algorithm*/
+    void prepareToPlay (double& sampleRate) noexcept
+    {
+        currentSampleRate = sampleRate;
+        updateCoefficients();
+    }
+
+    void setAttack (const Type seconds) noexcept
+    {
+        attackTime = seconds;
+        updateCoefficients();
+    }
+
+    void setDecay (const Type seconds) noexcept
+    {
+        decayTime = seconds;
+        updateCoefficients();
+    }
+
+    /** The sustain level should be between 0.0 and 1.0 */
+    void setSustain (const Type level) noexcept
+    {
+        assert (level >= 0.0 && level <= 1.0);
+        sustainLevel = level;
+        updateCoefficients();
+    }
+
+    void setRelease (const Type seconds) noexcept
+    {
+        releaseTime = seconds;
+        updateCoefficients();
+    }
+
+    /** Start (or retrigger) the attack at sampleOffset samples into the next block.  Retriggers start from the current level, so they don't click. */
+    void noteOn (const int sampleOffset = 0) noexcept
+    {
+        addEvent (sampleOffset, EnvelopeStage::Attack);
+    }
+
+    /** Start the release at sampleOffset samples into the next block */
+    void noteOff (const int sampleOffset = 0) noexcept
+    {
+        addEvent (sampleOffset, EnvelopeStage::Release);
+    }
+
+    /** Jump straight back to silence */
+    void reset() noexcept
+    {
+        stage = EnvelopeStage::Idle;
+        value = 0;
+        numEvents = 0;
+    }
+
+    /**
+        Renders the next block of the envelope.  Returns false if the envelope sat at a constant level for the
+        whole block (idle or sustaining), in which case nothing is written to output and getValue() holds that level.
+        Use this to skip work for voices that are idle or sustaining.
+     */
+    bool renderBlock (Type* output, const int numSamples) noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+
+        auto written = false;
+        auto constantValue = value;
+        auto position = 0;
+        auto eventIndex = 0;
+
+        while (position < numSamples)
+        {
+            while (eventIndex < numEvents && events[eventIndex].offset <= position)
+                startStage (events[eventIndex++].stage);
+
+            auto end = eventIndex < numEvents ? std::min (events[eventIndex].offset, numSamples) : numSamples;
+
+            while (position < end)
+            {
+                if (stage == EnvelopeStage::Idle || stage == EnvelopeStage::Sustain)
+                {
+                    if (written || value != constantValue)
+                    {
+                        if (! written)
+                            std::fill (output, output + position, constantValue);
+
+                        std::fill (output + position, output + end, value);
+                        written = true;
+                    }
+
+                    position = end;
+                    break;
+                }
+
+                if (! written)
+                {
+                    std::fill (output, output + position, constantValue);
+                    written = true;
+                }
+
+                auto count = std::min (end - position, samplesToStageEnd);
+                auto coefficient = segment.coefficient;
+                auto base = segment.base;
+                auto current = value;
+
+                for (auto sample = position; sample < position + count; ++sample)
+                {
+                    current = base + current * coefficient;
+                    output[sample] = current;
+                }
+
+                value = current;
+                position += count;
+                samplesToStageEnd -= count;
+
+                if (samplesToStageEnd <= 0)
+                {
+                    output[position - 1] = finishStage();
+
+                    if (stage == EnvelopeStage::Decay)
+                        startStage (EnvelopeStage::Decay);
+                }
+            }
+        }
+
+        while (eventIndex < numEvents)
+            startStage (events[eventIndex++].stage);
+
+        numEvents = 0;
+        return written;
+    }
+
+    Type getValue() const noexcept
+    {
+        return value;
+    }
+
+    EnvelopeStage getStage() const noexcept
+    {
+        return stage;
+    }
+
+    bool isActive() const noexcept
+    {
+        return stage != EnvelopeStage::Idle;
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    struct Segment
+    {
+        Type coefficient = 0;
+        Type base = 0;
+        Type target = 0;
+    };
+
+    struct Event
+    {
+        int offset;
+        EnvelopeStage stage;
+    };
+
+    // Smaller ratios give more exponential curves
+    static constexpr Type attackTargetRatio = 0.3;
+    static constexpr Type decayReleaseTargetRatio = 0.0001;
+    static constexpr int maxEvents = 8;
+
+    double currentSampleRate = 0;
+    Type attackTime = 0.01, decayTime = 0.1, sustainLevel = 0.7, releaseTime = 0.2;
+    Type attackCoefficient = 0, decayCoefficient = 0, releaseCoefficient = 0;
+
+    EnvelopeStage stage = EnvelopeStage::Idle;
+    Segment segment;
+    Type value = 0;
+    int samplesToStageEnd = 0;
+
+    Event events[maxEvents];
+    int numEvents = 0;
+
+    static Type calculateCoefficient (const Type seconds, const double sampleRate, const Type targetRatio) noexcept
+    {
+        auto numSamples = seconds * sampleRate;
+
+        if (numSamples <= 1.0)
+            return 0;
+
+        return static_cast<Type> (std::exp (-std::log ((1.0 + targetRatio) / targetRatio) / numSamples));
+    }
+
+    void updateCoefficients() noexcept
+    {
+        if (currentSampleRate <= 0)
+            return;
+
+        attackCoefficient  = calculateCoefficient (attackTime, currentSampleRate, attackTargetRatio);
+        decayCoefficient   = calculateCoefficient (decayTime, currentSampleRate, decayReleaseTargetRatio);
+        releaseCoefficient = calculateCoefficient (releaseTime, currentSampleRate, decayReleaseTargetRatio);
+
+        if (stage != EnvelopeStage::Idle && stage != EnvelopeStage::Sustain)
+            startStage (stage);
+        else if (stage == EnvelopeStage::Sustain)
+            value = sustainLevel;
+    }
+
+    void addEvent (const int sampleOffset, const EnvelopeStage newStage) noexcept
+    {
+        // Events must be added in order, and there's only room for a few per block
+        assert (numEvents == 0 || sampleOffset >= events[numEvents - 1].offset);
+        assert (numEvents < maxEvents);
+
+        if (numEvents < maxEvents)
+            events[numEvents++] = { std::max (0, sampleOffset), newStage };
+    }
+
+    /** Set up the recurrence for a segment, and work out how many samples it takes to reach its end point */
+    void startStage (const EnvelopeStage newStage) noexcept
+    {
+        // Nothing to release if we're already silent
+        if (newStage == EnvelopeStage::Release && stage == EnvelopeStage::Idle)
+            return;
+
+        stage = newStage;
+
+        Type coefficient = 0, target = 0, endPoint = 0;
+
+        switch (stage)
+        {
+            case EnvelopeStage::Attack:
+                coefficient = attackCoefficient;
+                target = 1 + attackTargetRatio;
+                endPoint = 1;
+                break;
+            case EnvelopeStage::Decay:
+                coefficient = decayCoefficient;
+                target = sustainLevel - decayReleaseTargetRatio;
+                endPoint = sustainLevel;
+                break;
+            case EnvelopeStage::Release:
+                coefficient = releaseCoefficient;
+                target = -decayReleaseTargetRatio;
+                endPoint = 0;
+                break;
+            case EnvelopeStage::Idle:
+            case EnvelopeStage::Sustain:
+            default:
+                return;
+        }
+
+        segment.coefficient = coefficient;
+        segment.base = target * (1 - coefficient);
+        segment.target = endPoint;
+
+        // (value - target) * coefficient^n crosses (endPoint - target) after n samples
+        auto distance = (endPoint - target) / (value - target);
+
+        if (coefficient <= 0 || distance >= 1 || distance <= 0)
+            samplesToStageEnd = 1;
+        else
+            samplesToStageEnd = std::max (1, static_cast<int> (std::ceil (std::log (distance) / std::log (coefficient))));
+    }
+
+    /** Snap to the end point of the current segment and move on to the next stage.  Returns the new value. */
+    Type finishStage() noexcept
+    {
+        value = segment.target;
+
+        switch (stage)
+        {
+            case EnvelopeStage::Attack:  stage = EnvelopeStage::Decay;   break;
+            case EnvelopeStage::Decay:   stage = EnvelopeStage::Sustain; break;
+            case EnvelopeStage::Release: stage = EnvelopeStage::Idle;    break;
+            case EnvelopeStage::Idle:
+            case EnvelopeStage::Sustain:
+            default:                                                     break;
+        }
+
+        return value;
+    }
+};
+
+// =================================================================
+
+/**
+    An in-place radix-2 complex FFT.  The twiddle factors and bit-reversal table are worked out in
+    prepare(), so perform() doesn't call any trig functions or allocate.
+ */
+
+template <typename Type>
+class FFT
+{
+public:
+    /** Allocate tables for an FFT of size 2 ^ fftOrder */
+    void prepare (const int fftOrder)
+    {
+        assert (fftOrder > 0 && fftOrder < 31);
+
+        size = 1 << fftOrder;
+        twiddles.resize (static_cast<size_t> (size / 2));
+        bitReversed.resize (static_cast<size_t> (size));
+
+        for (auto i = 0; i < size / 2; ++i)
+            twiddles[static_cast<size_t> (i)] = std::polar (Type (1), static_cast<Type> (-2.0 * pi * i / size));
+
+        for (auto i = 0; i < size; ++i)
+        {
+            auto reversed = 0;
+
+            for (auto bit = 0; bit < fftOrder; ++bit)
+                reversed |= ((i >> bit) & 1) << (fftOrder - 1 - bit);
+
+            bitReversed[static_cast<size_t> (i)] = reversed;
+        }
+    }
+
+    int getSize() const noexcept
+    {
+        return size;
+    }
+
+    /** Transforms getSize() values in place.  The inverse transform is scaled by 1 / size, so a round trip gives back the input. */
+    void perform (std::complex<Type>* data, const bool inverse) const noexcept
+    {
+        // You must call prepare() first
+        assert (size > 0);
+
+        for (auto i = 0; i < size; ++i)
+        {
+            auto j = bitReversed[static_cast<size_t> (i)];
+
+            if (i < j)
+                std::swap (data[i], data[j]);
+        }
+
+        for (auto length = 2; length <= size; length <<= 1)
+        {
+            auto halfLength = length / 2;
+            auto twiddleStep = size / length;
+
+            for (auto start = 0; start < size; start += length)
+            {
+                for (auto k = 0; k < halfLength; ++k)
+                {
+                    auto twiddle = twiddles[static_cast<size_t> (k * twiddleStep)];
+
+                    if (inverse)
+                        twiddle = std::conj (twiddle);
+
+                    auto odd = data[start + k + halfLength] * twiddle;
+                    data[start + k + halfLength] = data[start + k] - odd;
+                    data[start + k] += odd;
+                }
+            }
+        }
+
+        if (inverse)
+        {
+            auto scale = Type (1) / static_cast<Type> (size);
+
+            for (auto i = 0; i < size; ++i)
+                data[i] *= scale;
+        }
+    }
+
+private:
+    static constexpr double pi = 3.141592653589793238;
+    int size = 0;
+    std::vector<std::complex<Type>> twiddles;
+    std::vector<int> bitReversed;
+};
+
+// =================================================================
+
+/**
+    A monophonic pitch detector using the YIN algorithm.  The slow part of YIN is the difference function,
+    which is O(N^2) done directly, so here it's built from an FFT autocorrelation in O(N log N) instead.
+    Feed it audio with process(), and it re-analyses the most recent window every hopSize samples.
+    The result is refined with parabolic interpolation, so you can drive a SynthWave with it:
+
+        detector.process (input, numSamples);
+
+        if (detector.getConfidence() > 0.8f)
+            output[i] = wave.processSine (detector.getFrequency());
+ */
+
+template <typename Type>
+class PitchDetector
+{
+public:
+    /** windowSize must be a power of 2 and sets the lowest detectable pitch (sampleRate / windowSize) */
+    void prepareToPlay (double& sampleRate, const int windowSizeToUse, const int hopSizeToUse)
+    {
+        // The window size must be a power of 2
+        assert (windowSizeToUse > 0 && (windowSizeToUse & (windowSizeToUse - 1)) == 0);
+        assert (hopSizeToUse > 0);
+
+        currentSampleRate = sampleRate;
+        windowSize = windowSizeToUse;
+        hopSize = hopSizeToUse;
+
+        auto order = 1;
+
+        while ((1 << order) < 2 * windowSize)
+            ++order;
+
+        fft.prepare (order);
+
+        history.assign (static_cast<size_t> (2 * windowSize), Type (0));
+        frame.assign (static_cast<size_t> (2 * windowSize), Type (0));
+        windowSpectrum.assign (static_cast<size_t> (2 * windowSize), {});
+        frameSpectrum.assign (static_cast<size_t> (2 * windowSize), {});
+        difference.assign (static_cast<size_t> (windowSize), Type (0));
+
+        writeIndex = 0;
+        samplesUntilAnalysis = 2 * windowSize;
+        frequency = 0;
+        confidence = 0;
+    }
+
+    /** Set the range of pitches to search.  Narrowing it makes the detector faster and less prone to octave errors. */
+    void setFrequencyRange (const Type lowest, const Type highest) noexcept
+    {
+        assert (lowest > 0 && highest > lowest);
+        lowestFrequency = lowest;
+        highestFrequency = highest;
+    }
+
+    /** Values between 0.1 and 0.2 work well.  Lower values are stricter about what counts as pitched. */
+    void setThreshold (const Type newThreshold) noexcept
+    {
+        threshold = newThreshold;
+    }
+
+    void process (const Type* input, const int numSamples) noexcept
+    {
+        // You must call prepareToPlay first
+        assert (windowSize > 0);
+
+        auto historySize = 2 * windowSize;
+
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            history[static_cast<size_t> (writeIndex)] = input[i];
+            writeIndex = (writeIndex + 1) % historySize;
+
+            if (--samplesUntilAnalysis <= 0)
+            {
+                analyse();
+                samplesUntilAnalysis = hopSize;
+            }
+        }
+    }
+
+    /** The most recent pitch estimate in Hz, or 0 if nothing pitched has been found */
+    Type getFrequency() const noexcept
+    {
+        return frequency;
+    }
+
+    /** How periodic the signal was, from 0 (noise) to 1 (perfectly periodic) */
+    Type getConfidence() const noexcept
+    {
+        return confidence;
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    FFT<Type> fft;
+    double currentSampleRate = 0;
+    int windowSize = 0;
+    int hopSize = 0;
+    int writeIndex = 0;
+    int samplesUntilAnalysis = 0;
+
+    Type lowestFrequency = 50;
+    Type highestFrequency = 2000;
+    Type threshold = 0.15;
+    Type frequency = 0;
+    Type confidence = 0;
+
+    std::vector<Type> history;
+    std::vector<Type> frame;
+    std::vector<std::complex<Type>> windowSpectrum;
+    std::vector<std::complex<Type>> frameSpectrum;
+    std::vector<Type> difference;
+
+    void analyse() noexcept
+    {
+        auto frameSize = 2 * windowSize;
+        auto fftSize = fft.getSize();
+
+        // Unwrap the circular history so the oldest sample comes first
+        for (auto i = 0; i < frameSize; ++i)
+            frame[static_cast<size_t> (i)] = history[static_cast<size_t> ((writeIndex + i) % frameSize)];
+
+        // r(tau) = sum of x[j] * x[j + tau] over the first window, as a cross-correlation done with the FFT
+        for (auto i = 0; i < fftSize; ++i)
+        {
+            auto sample = i < frameSize ? frame[static_cast<size_t> (i)] : Type (0);
+            frameSpectrum[static_cast<size_t> (i)] = sample;
+            windowSpectrum[static_cast<size_t> (i)] = i < windowSize ? sample : Type (0);
+        }
+
+        fft.perform (windowSpectrum.data(), false);
+        fft.perform (frameSpectrum.data(), false);
+
+        for (auto i = 0; i < fftSize; ++i)
+            frameSpectrum[static_cast<size_t> (i)] *= std::conj (windowSpectrum[static_cast<size_t> (i)]);
+
+        fft.perform (frameSpectrum.data(), true);
+
+        // d(tau) = energy of the first window + energy of the shifted window - 2 r(tau)
+        Type firstEnergy = 0;
+
+        for (auto i = 0; i < windowSize; ++i)
+            firstEnergy += frame[static_cast<size_t> (i)] * frame[static_cast<size_t> (i)];
+
+        auto shiftedEnergy = firstEnergy;
+        difference[0] = 1;
+        Type runningSum = 0;
+
+        for (auto tau = 1; tau < windowSize; ++tau)
+        {
+            auto leaving  = frame[static_cast<size_t> (tau - 1)];
+            auto entering = frame[static_cast<size_t> (tau + windowSize - 1)];
+            shiftedEnergy += entering * entering - leaving * leaving;
+
+            auto d = std::max (Type (0), firstEnergy + shiftedEnergy - 2 * frameSpectrum[static_cast<size_t> (tau)].real());
+
+            // Cumulative mean normalised difference
+            runningSum += d;
+            difference[static_cast<size_t> (tau)] = runningSum > 0 ? d * tau / runningSum : Type (1);
+        }
+
+        auto minLag = std::max (2, static_cast<int> (currentSampleRate / highestFrequency));
+        auto maxLag = std::min (windowSize - 2, static_cast<int> (currentSampleRate / lowestFrequency));
+
+        auto bestLag = -1;
+
+        for (auto tau = minLag; tau <= maxLag; ++tau)
+        {
+            if (difference[static_cast<size_t> (tau)] < threshold)
+            {
+                // Walk down to the bottom of this dip
+                while (tau + 1 <= maxLag && difference[static_cast<size_t> (tau + 1)] < difference[static_cast<size_t> (tau)])
+                    ++tau;
+
+                bestLag = tau;
+                break;
+            }
+        }
+
+        if (bestLag < 0)
+        {
+            frequency = 0;
+            confidence = 0;
+            return;
+        }
+
+        // Parabolic interpolation between the neighbouring lags
+        auto previous = difference[static_cast<size_t> (bestLag - 1)];
+        auto current  = difference[static_cast<size_t> (bestLag)];
+        auto next     = difference[static_cast<size_t> (bestLag + 1)];
+        auto curvature = previous - 2 * current + next;
+        auto offset = curvature > 0 ? Type (0.5) * (previous - next) / curvature : Type (0);
+
+        frequency = static_cast<Type> (currentSampleRate / (bestLag + offset));
+        confidence = Type (1) - current;
+    }
+};
+
+// =================================================================
+
+enum class GoertzelMode
+{
+    BlockHop,   // Analyse consecutive, non-overlapping windows.  Cheapest, but results only update once per window.
+    Sliding     // Update every bin on every sample, over the most recent window
+};
+
+/**
+    Watches a handful of target frequencies (DTMF tones, pilot tones, test tones...) for far less than a
+    full FFT.  Coefficients are only recomputed when the targets change, and every bin is stored as a
+    structure of arrays so the per-sample update vectorises across bins.
+
+    Block-hop mode runs the classic Goertzel recurrence.  Sliding mode runs a sliding DFT per bin, which
+    needs a window of history and double precision state to stay accurate over long runs.
+ */
+
+template <typename Type>
+class GoertzelBank
+{
+public:
+    /** windowSize sets the frequency resolution, sampleRate / windowSize Hz */
+    void prepareToPlay (double& sampleRate, const int windowSizeToUse)
+    {
+        assert (windowSizeToUse > 0);
+
+        currentSampleRate = sampleRate;
+        windowSize = windowSizeToUse;
+        history.assign (static_cast<size_t> (windowSize), Type (0));
+
+        setTargets (targets);
+    }
+
+    void setMode (const GoertzelMode newMode) noexcept
+    {
+        mode = newMode;
+        reset();
+    }
+
+    /** Set the frequencies to watch.  This allocates, so do it off the audio thread. */
+    void setTargets (const std::vector<Type>& frequencies)
+    {
+        targets = frequencies;
+
+        auto numBins = targets.size();
+        coefficients.resize (numBins);
+        rotationReal.resize (numBins);
+        rotationImag.resize (numBins);
+        windowReal.resize (numBins);
+        windowImag.resize (numBins);
+        magnitudes.assign (numBins, Type (0));
+
+        if (currentSampleRate <= 0)
+            return;
+
+        for (size_t bin = 0; bin < numBins; ++bin)
+        {
+            auto omega = 2.0 * pi * targets[bin] / currentSampleRate;
+            coefficients[bin] = 2.0 * std::cos (omega);
+            rotationReal[bin] = std::cos (omega);
+            rotationImag[bin] = std::sin (omega);
+            windowReal[bin]   = std::cos (omega * windowSize);
+            windowImag[bin]   = -std::sin (omega * windowSize);
+        }
+
+        reset();
+    }
+
+    void reset() noexcept
+    {
+        auto numBins = targets.size();
+        state1.assign (numBins, 0.0);
+        state2.assign (numBins, 0.0);
+        std::fill (magnitudes.begin(), magnitudes.end(), Type (0));
+        std::fill (history.begin(), history.end(), Type (0));
+        position = 0;
+    }
+
+    void process (const Type* input, const int numSamples) noexcept
+    {
+        // You must call prepareToPlay first
+        assert (windowSize > 0);
+
+        if (mode == GoertzelMode::BlockHop)
+            processBlockHop (input, numSamples);
+        else
+            processSliding (input, numSamples);
+    }
+
+    /** The amplitude of a target frequency (a full scale sine at that frequency reads about 1.0) */
+    Type getMagnitude (const int bin) const noexcept
+    {
+        return magnitudes[static_cast<size_t> (bin)];
+    }
+
+    int getNumTargets() const noexcept
+    {
+        return static_cast<int> (targets.size());
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    static constexpr double pi = 3.141592653589793238;
+    double currentSampleRate = 0;
+    int windowSize = 0;
+    int position = 0;
+    GoertzelMode mode = GoertzelMode::BlockHop;
+
+    std::vector<Type> targets;
+    std::vector<double> coefficients;
+    std::vector<double> rotationReal, rotationImag;
+    std::vector<double> windowReal, windowImag;
+
+    // Goertzel's s[n - 1] and s[n - 2] in block-hop mode, the real and imaginary parts of each bin in sliding mode
+    std::vector<double> state1, state2;
+    std::vector<Type> magnitudes;
+    std::vector<Type> history;
+
+    void processBlockHop (const Type* input, const int numSamples) noexcept
+    {
+        auto numBins = targets.size();
+        auto* s1 = state1.data();
+        auto* s2 = state2.data();
+        const auto* coefficient = coefficients.data();
+
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            double sample = input[i];
+
+            for (size_t bin = 0; bin < numBins; ++bin)
+            {
+                auto s0 = sample + coefficient[bin] * s1[bin] - s2[bin];
+                s2[bin] = s1[bin];
+                s1[bin] = s0;
+            }
+
+            if (++position >= windowSize)
+            {
+                for (size_t bin = 0; bin < numBins; ++bin)
+                {
+                    auto power = s1[bin] * s1[bin] + s2[bin] * s2[bin] - coefficient[bin] * s1[bin] * s2[bin];
+                    magnitudes[bin] = static_cast<Type> (2.0 * std::sqrt (std::max (0.0, power)) / windowSize);
+                    s1[bin] = s2[bin] = 0;
+                }
+
+                position = 0;
+            }
+        }
+    }
+
+    void processSliding (const Type* input, const int numSamples) noexcept
+    {
+        auto numBins = targets.size();
+        auto* real = state1.data();
+        auto* imag = state2.data();
+
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            double newest = input[i];
+            double oldest = history[static_cast<size_t> (position)];
+            history[static_cast<size_t> (position)] = input[i];
+            position = (position + 1) % windowSize;
+
+            // X[n] = e^jw * (X[n - 1] - x[n - N] + x[n] * e^-jwN)
+            for (size_t bin = 0; bin < numBins; ++bin)
+            {
+                auto re = real[bin] - oldest + newest * windowReal[bin];
+                auto im = imag[bin] + newest * windowImag[bin];
+                real[bin] = re * rotationReal[bin] - im * rotationImag[bin];
+                imag[bin] = re * rotationImag[bin] + im * rotationReal[bin];
+            }
+        }
+
+        for (size_t bin = 0; bin < numBins; ++bin)
+            magnitudes[bin] = static_cast<Type> (2.0 * std::sqrt (real[bin] * real[bin] + imag[bin] * imag[bin]) / windowSize);
+    }
+};
+
+// =================================================================
+
+/**
+    A sine and cosine oscillator that rotates a (sin, cos) pair by a fixed angle every sample.  That's two
+    multiply-adds per output instead of two calls to std::sin and std::cos.  Rounding error slowly pushes
+    the pair off the unit circle, so it's pulled back every renormaliseInterval samples.
+ */
+
+template <typename Type>
+class QuadratureOscillator
+{
+public:
+    /** Pass the sample rate to the DSP algorithm*/
+    void prepareToPlay (double& sampleRate) noexcept
+    {
+        currentSampleRate = sampleRate;
+        setFrequency (frequency);
+    }
+
+    /** Negative frequencies rotate the other way, which swaps the sign of the sine output */
+    void setFrequency (const Type freq) noexcept
+    {
+        frequency = freq;
+
+        if (currentSampleRate <= 0)
+            return;
+
+        auto increment = 2.0 * pi * frequency / currentSampleRate;
+        sinIncrement = static_cast<Type> (std::sin (increment));
+        cosIncrement = static_cast<Type> (std::cos (increment));
+    }
+
+    /** Restart at a phase in radians */
+    void setPhase (const Type phase) noexcept
+    {
+        sinValue = std::sin (phase);
+        cosValue = std::cos (phase);
+        samplesSinceRenormalise = 0;
+    }
+
+    /** Moves on by one sample.  Read the new values with getSin() and getCos(). */
+    void advance() noexcept
+    {
+        auto newSin = sinValue * cosIncrement + cosValue * sinIncrement;
+        cosValue    = cosValue * cosIncrement - sinValue * sinIncrement;
+        sinValue    = newSin;
+
+        if (++samplesSinceRenormalise >= renormaliseInterval)
+        {
+            auto gain = Type (1.5) - Type (0.5) * (sinValue * sinValue + cosValue * cosValue);
+            sinValue *= gain;
+            cosValue *= gain;
+            samplesSinceRenormalise = 0;
+        }
+    }
+
+    Type getSin() const noexcept
+    {
+        return sinValue;
+    }
+
+    Type getCos() const noexcept
+    {
+        return cosValue;
+    }
+
+    /** Fills either output (pass nullptr to skip one) with numSamples of the oscillator */
+    void processBlock (Type* sinOutput, Type* cosOutput, const int numSamples) noexcept
+    {
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            if (sinOutput != nullptr)
+                sinOutput[i] = sinValue;
+
+            if (cosOutput != nullptr)
+                cosOutput[i] = cosValue;
+
+            advance();
+        }
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    static constexpr double pi = 3.141592653589793238;
+    static constexpr int renormaliseInterval = 64;
+
+    double currentSampleRate = 0;
+    Type frequency = 0;
+    Type sinIncrement = 0, cosIncrement = 1;
+    Type sinValue = 0, cosValue = 1;
+    int samplesSinceRenormalise = 0;
+};
+
+// =================================================================
+
+/**
+    Turns a real signal into an analytic one (an in-phase and a quadrature part, 90 degrees apart) with two
+    chains of allpass filters.  The coefficients are Olli Niemitalo's, which hold the 90 degree difference to
+    within a fraction of a degree from about 15 Hz up to 20 kHz at 44.1 kHz.
+
+    The filter state is stored section by section with all of the channels side by side, so each section
+    updates every channel in one loop that vectorises.
+ */
+
+template <typename Type>
+class HilbertTransformer
+{
+public:
+    void prepare (const int numChannelsToUse)
+    {
+        // Too many channels for an AudioBlock!
+        assert (numChannelsToUse <= AudioBlock<Type>::maxChannels);
+
+        numChannels = numChannelsToUse;
+        state.assign (static_cast<size_t> (2 * numSections * 4 * numChannels), Type (0));
+        delayedInPhase.assign (static_cast<size_t> (numChannels), Type (0));
+    }
+
+    void reset() noexcept
+    {
+        std::fill (state.begin(), state.end(), Type (0));
+        std::fill (delayedInPhase.begin(), delayedInPhase.end(), Type (0));
+    }
+
+    /** Replaces the contents of block with the in-phase part and writes the quadrature part into quadrature */
+    void process (AudioBlock<Type>& block, AudioBlock<Type>& quadrature) noexcept
+    {
+        assert (block.getNumChannels() <= numChannels && quadrature.getNumChannels() >= block.getNumChannels());
+
+        auto channels = block.getNumChannels();
+        Type frameA[AudioBlock<Type>::maxChannels];
+        Type frameB[AudioBlock<Type>::maxChannels];
+
+        for (auto sample = 0; sample < block.getNumSamples(); ++sample)
+        {
+            for (auto channel = 0; channel < channels; ++channel)
+                frameA[channel] = frameB[channel] = block.getChannelPointer (channel)[sample];
+
+            runChain (0, coefficientsA, frameA, channels);
+            runChain (1, coefficientsB, frameB, channels);
+
+            for (auto channel = 0; channel < channels; ++channel)
+            {
+                // Chain A needs one extra sample of delay to line up with chain B
+                block.getChannelPointer (channel)[sample] = delayedInPhase[static_cast<size_t> (channel)];
+                delayedInPhase[static_cast<size_t> (channel)] = frameA[channel];
+                quadrature.getChannelPointer (channel)[sample] = frameB[channel];
+            }
+        }
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    static constexpr int numSections = 4;
+
+    // Each section is y[n] = a^2 * (x[n] + y[n - 2]) - x[n - 2].  These are the a^2 values.
+    static constexpr Type coefficientsA[numSections] = { Type (0.6923878 * 0.6923878),
+                                                         Type (0.9360654322959 * 0.9360654322959),
+                                                         Type (0.9882295226860 * 0.9882295226860),
+                                                         Type (0.9987488452737 * 0.9987488452737) };
+
+    static constexpr Type coefficientsB[numSections] = { Type (0.4021921162426 * 0.4021921162426),
+                                                         Type (0.8561710882420 * 0.8561710882420),
+                                                         Type (0.9722909545651 * 0.9722909545651),
+                                                         Type (0.9952884791278 * 0.9952884791278) };
+
+    int numChannels = 0;
+
+    // For each chain and section: x[n - 1], x[n - 2], y[n - 1], y[n - 2], each with one value per channel
+    std::vector<Type> state;
+    std::vector<Type> delayedInPhase;
+
+    void runChain (const int chain, const Type* coefficients, Type* frame, const int channels) noexcept
+    {
+        for (auto section = 0; section < numSections; ++section)
+        {
+            auto* x1 = state.data() + ((chain * numSections + section) * 4 + 0) * numChannels;
+            auto* x2 = x1 + numChannels;
+            auto* y1 = x2 + numChannels;
+            auto* y2 = y1 + numChannels;
+            auto a = coefficients[section];
+
+            for (auto channel = 0; channel < channels; ++channel)
+            {
+                auto input = frame[channel];
+                auto output = a * (input + y2[channel]) - x2[channel];
+
+                x2[channel] = x1[channel];
+                x1[channel] = input;
+                y2[channel] = y1[channel];
+                y1[channel] = output;
+                frame[channel] = output;
+            }
+        }
+    }
+};
+
+template <typename Type>
+constexpr Type HilbertTransformer<Type>::coefficientsA[];
+
+template <typename Type>
+constexpr Type HilbertTransformer<Type>::coefficientsB[];
+
+// =================================================================
+
+/**
+    A single-sideband frequency shifter.  Every frequency in the input is moved up (or down, with a negative shift)
+    by the same number of Hz, which unlike pitch shifting makes harmonic sounds inharmonic.
+ */
+
+template <typename Type>
+class FrequencyShifter : public BlockProcessor<Type>
+{
+public:
+    void setShift (const Type hertz) noexcept
+    {
+        oscillator.setFrequency (hertz);
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        auto sampleRate = spec.sampleRate;
+        oscillator.prepareToPlay (sampleRate);
+        hilbert.prepare (spec.numChannels);
+        quadrature.setSize (spec.numChannels, spec.maximumBlockSize);
+        sinTable.assign (static_cast<size_t> (spec.maximumBlockSize), Type (0));
+        cosTable.assign (static_cast<size_t> (spec.maximumBlockSize), Type (0));
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        auto numSamples = block.getNumSamples();
+        auto quadratureBlock = quadrature.getBlock (numSamples);
+
+        hilbert.process (block, quadratureBlock);
+        oscillator.processBlock (sinTable.data(), cosTable.data(), numSamples);
+
+        for (auto channel = 0; channel < block.getNumChannels(); ++channel)
+        {
+            auto* data = block.getChannelPointer (channel);
+            const auto* imag = quadratureBlock.getChannelPointer (channel);
+
+            for (auto sample = 0; sample < numSamples; ++sample)
+                data[sample] = data[sample] * cosTable[static_cast<size_t> (sample)] + imag[sample] * sinTable[static_cast<size_t> (sample)];
+        }
+    }
+
+    void reset() override
+    {
+        hilbert.reset();
+        oscillator.setPhase (0);
+    }
+
+private:
+    QuadratureOscillator<Type> oscillator;
+    HilbertTransformer<Type> hilbert;
+    AudioBuffer<Type> quadrature;
+    std::vector<Type> sinTable, cosTable;
+};
+
+// =================================================================
+
+/** Multiplies the input by a sine wave, giving both sum and difference frequencies */
+template <typename Type>
+class RingModulator : public BlockProcessor<Type>
+{
+public:
+    void setFrequency (const Type hertz) noexcept
+    {
+        oscillator.setFrequency (hertz);
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        auto sampleRate = spec.sampleRate;
+        oscillator.prepareToPlay (sampleRate);
+        carrier.assign (static_cast<size_t> (spec.maximumBlockSize), Type (0));
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        auto numSamples = block.getNumSamples();
+        oscillator.processBlock (carrier.data(), nullptr, numSamples);
+
+        for (auto channel = 0; channel < block.getNumChannels(); ++channel)
+        {
+            auto* data = block.getChannelPointer (channel);
+
+            for (auto sample = 0; sample < numSamples; ++sample)
+                data[sample] *= carrier[static_cast<size_t> (sample)];
+        }
+    }
+
+    void reset() override
+    {
+        oscillator.setPhase (0);
+    }
+
+private:
+    QuadratureOscillator<Type> oscillator;
+    std::vector<Type> carrier;
+};
+
+// =================================================================
+
+/**
+    A bank of user wavetables: one or more single-cycle frames that an oscillator can morph between.
+
+    Each frame is stored at several band-limited mip-map levels, one per octave, where level L keeps only the
+    lowest (tableSize / 2) >> L harmonics.  Level 0 is ready as soon as the frames are loaded, and the rest are
+    built by FFT on a background thread.  Until a level is ready, oscillators fall back to the nearest ready one.
+
+    A finished bank can be saved to a binary cache file and loaded from it next time, which skips the FFTs.
+    Don't load new frames into a bank while an oscillator is playing it, build a new bank instead.
+ */
+
+template <typename Type>
+class WavetableBank
+{
+public:
+    static constexpr int tableSize = 2048;
+    static constexpr int numLevels = 11;
+
+    ~WavetableBank()
+    {
+        stopBuilding();
+    }
+
+    /** Load numFrames single-cycle frames of frameLength samples each, one after another in samples.
+        Frames that aren't tableSize long are resampled.  This allocates, so call it off the audio thread.
+     */
+    void loadFrames (const Type* samples, const int frameLength, const int numFramesToLoad)
+    {
+        assert (frameLength > 1 && numFramesToLoad > 0);
+
+        stopBuilding();
+        allocate (numFramesToLoad);
+
+        for (auto frame = 0; frame < numFrames; ++frame)
+        {
+            auto* source = samples + frame * frameLength;
+            auto* destination = getWritableTable (0, frame);
+
+            for (auto i = 0; i < tableSize; ++i)
+            {
+                auto position = static_cast<double> (i) * frameLength / tableSize;
+                auto index = static_cast<int> (position);
+                auto fraction = static_cast<Type> (position - index);
+                auto next = (index + 1) % frameLength;
+                destination[i] = source[index] + fraction * (source[next] - source[index]);
+            }
+
+            destination[tableSize] = destination[0];
+        }
+
+        readyLevels.store (1, std::memory_order_release);
+        cancelBuild.store (false);
+        buildThread = std::thread ([this] { buildMipMaps(); });
+    }
+
+    /** Saves every level to a cache file.  Returns false if the mip-maps aren't finished yet or the file couldn't be written. */
+    bool saveToFile (const std::string& path) const
+    {
+        if (getNumReadyLevels() < numLevels)
+            return false;
+
+        std::ofstream stream (path, std::ios::binary);
+
+        if (! stream)
+            return false;
+
+        const int header[] = { fileMagic, static_cast<int> (sizeof (Type)), tableSize, numLevels, numFrames };
+        stream.write (reinterpret_cast<const char*> (header), sizeof (header));
+        stream.write (reinterpret_cast<const char*> (tables.data()), static_cast<std::streamsize> (tables.size() * sizeof (Type)));
+        return stream.good();
+    }
+
+    /** Loads a bank written by saveToFile(), with every level ready straight away.  Returns false if the file is missing or doesn't match. */
+    bool loadFromFile (const std::string& path)
+    {
+        std::ifstream stream (path, std::ios::binary);
+
+        if (! stream)
+            return false;
+
+        int header[5] = {};
+        stream.read (reinterpret_cast<char*> (header), sizeof (header));
+
+        if (! stream || header[0] != fileMagic || header[1] != static_cast<int> (sizeof (Type))
+             || header[2] != tableSize || header[3] != numLevels || header[4] <= 0)
+            return false;
+
+        stopBuilding();
+        allocate (header[4]);
+        stream.read (reinterpret_cast<char*> (tables.data()), static_cast<std::streamsize> (tables.size() * sizeof (Type)));
+
+        if (! stream)
+        {
+            numFrames = 0;
+            return false;
+        }
+
+        readyLevels.store (numLevels, std::memory_order_release);
+        return true;
+    }
+
+    /** Blocks until the background thread has built every level */
+    void waitUntilReady()
+    {
+        if (buildThread.joinable())
+            buildThread.join();
+    }
+
+    int getNumFrames() const noexcept
+    {
+        return numFrames;
+    }
+
+    int getNumReadyLevels() const noexcept
+    {
+        return readyLevels.load (std::memory_order_acquire);
+    }
+
+    /** Returns tableSize + 1 samples (the last one repeats the first, to make interpolation easy) */
+    const Type* getTable (const int level, const int frame) const noexcept
+    {
+        return tables.data() + (static_cast<size_t> (level) * numFrames + frame) * (tableSize + 1);
+    }
+
+private:
+    static constexpr int fileMagic = 0x57504154; // "TAPW"
+
+    std::vector<Type> tables;
+    int numFrames = 0;
+    std::atomic<int> readyLevels { 0 };
+    std::atomic<bool> cancelBuild { false };
+    std::thread buildThread;
+
+    Type* getWritableTable (const int level, const int frame) noexcept
+    {
+        return tables.data() + (static_cast<size_t> (level) * numFrames + frame) * (tableSize + 1);
+    }
+
+    void allocate (const int numFramesToUse)
+    {
+        numFrames = numFramesToUse;
+        readyLevels.store (0);
+        tables.assign (static_cast<size_t> (numLevels * numFrames * (tableSize + 1)), Type (0));
+    }
+
+    void stopBuilding()
+    {
+        cancelBuild.store (true);
+
+        if (buildThread.joinable())
+            buildThread.join();
+    }
+
+    void buildMipMaps()
+    {
+        auto order = 0;
+
+        while ((1 << order) < tableSize)
+            ++order;
+
+        FFT<Type> fft;
+        fft.prepare (order);
+
+        std::vector<std::complex<Type>> spectra (static_cast<size_t> (numFrames * tableSize));
+        std::vector<std::complex<Type>> scratch (static_cast<size_t> (tableSize));
+
+        for (auto frame = 0; frame < numFrames; ++frame)
+        {
+            auto* spectrum = spectra.data() + frame * tableSize;
+            const auto* source = getTable (0, frame);
+
+            for (auto i = 0; i < tableSize; ++i)
+                spectrum[i] = source[i];
+
+            fft.perform (spectrum, false);
+        }
+
+        for (auto level = 1; level < numLevels; ++level)
+        {
+            auto maxHarmonic = (tableSize / 2) >> level;
+
+            for (auto frame = 0; frame < numFrames; ++frame)
+            {
+                if (cancelBuild.load())
+                    return;
+
+                const auto* spectrum = spectra.data() + frame * tableSize;
+
+                // Keep DC and the harmonics up to maxHarmonic (plus their negative frequency mirrors)
+                for (auto bin = 0; bin < tableSize; ++bin)
+                {
+                    auto harmonic = std::min (bin, tableSize - bin);
+                    scratch[static_cast<size_t> (bin)] = harmonic <= maxHarmonic ? spectrum[bin] : std::complex<Type>();
+                }
+
+                fft.perform (scratch.data(), true);
+
+                auto* destination = getWritableTable (level, frame);
+
+                for (auto i = 0; i < tableSize; ++i)
+                    destination[i] = scratch[static_cast<size_t> (i)].real();
+
+                destination[tableSize] = destination[0];
+            }
+
+            readyLevels.store (level + 1, std::memory_order_release);
+        }
+    }
+};
+
+// =================================================================
+
+/**
+    Plays a WavetableBank, morphing between its frames.  The mip-map level is chosen in setFrequency(), so that no
+    harmonic goes past Nyquist, and process() falls back to a lower level if that one hasn't been built yet.
+ */
+
+template <typename Type>
+class WavetableOscillator
+{
+public:
+    /** Pass the sample rate to the DSP algorithm*/
+    void prepareToPlay (double& sampleRate) noexcept
+    {
+        currentSampleRate = sampleRate;
+        setFrequency (frequency);
+    }
+
+    void setBank (const WavetableBank<Type>* newBank) noexcept
+    {
+        bank = newBank;
+    }
+
+    void setFrequency (const Type freq) noexcept
+    {
+        frequency = freq;
+
+        if (currentSampleRate <= 0 || frequency <= 0)
+            return;
+
+        phaseIncrement = static_cast<Type> (frequency / currentSampleRate);
+
+        // The highest harmonic at level L is (tableSize / 2) >> L, and it has to stay below Nyquist
+        auto harmonicsAllowed = currentSampleRate / (2.0 * frequency);
+        auto level = static_cast<int> (std::ceil (std::log2 ((WavetableBank<Type>::tableSize / 2) / harmonicsAllowed)));
+        idealLevel = std::max (0, std::min (level, WavetableBank<Type>::numLevels - 1));
+    }
+
+    /** Where to read between the first (0.0) and last (1.0) frame */
+    void setMorph (const Type position) noexcept
+    {
+        assert (position >= 0.0 && position <= 1.0);
+        morph = position;
+    }
+
+    Type process() noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+
+        if (bank == nullptr || bank->getNumReadyLevels() == 0)
+            return 0;
+
+        auto level = std::min (idealLevel, bank->getNumReadyLevels() - 1);
+        auto framePosition = morph * (bank->getNumFrames() - 1);
+        auto frameA = static_cast<int> (framePosition);
+        auto frameB = std::min (frameA + 1, bank->getNumFrames() - 1);
+        auto frameFraction = framePosition - frameA;
+
+        auto position = phase * WavetableBank<Type>::tableSize;
+        auto index = static_cast<int> (position);
+        auto fraction = position - index;
+
+        const auto* tableA = bank->getTable (level, frameA);
+        const auto* tableB = bank->getTable (level, frameB);
+        auto sampleA = tableA[index] + fraction * (tableA[index + 1] - tableA[index]);
+        auto sampleB = tableB[index] + fraction * (tableB[index + 1] - tableB[index]);
+
+        phase += phaseIncrement;
+
+        if (phase >= 1)
+            phase -= 1;
+
+        return sampleA + frameFraction * (sampleB - sampleA);
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    const WavetableBank<Type>* bank = nullptr;
+    double currentSampleRate = 0;
+    Type frequency = 0;
+    Type phase = 0;
+    Type phaseIncrement = 0;
+    Type morph = 0;
+    int idealLevel = 0;
+};
+
+// =================================================================
+
+/**
+    A precomputed minBLEP: a band-limited step with minimum phase, so all of its ringing comes after the step
+    rather than before it.  Oscillators add getResidual() (the minBLEP minus an ideal step) after each
+    discontinuity, which removes the aliasing a naive jump would cause.  Based on "Hard Sync Without Aliasing"
+    by Eli Brandt.  The table is built once, the first time it's asked for.
+ */
+
+template <typename Type>
+class MinBlep
+{
+public:
+    static constexpr int zeroCrossings = 16;
+    static constexpr int oversampling = 32;
+    static constexpr int length = zeroCrossings * 2;
+
+    /** The residual stored as oversampling + 1 rows of length samples each, where row j starts j / oversampling
+        samples after the step.  Each row is contiguous, so adding one is a straight vectorisable loop.
+     */
+    static const std::vector<Type>& getResidual()
+    {
+        static const std::vector<Type> residual = buildResidual();
+        return residual;
+    }
+
+    /** For a step that happened offset (0 to 1) samples before output[0], adds height times residual samples
+        [firstSample, firstSample + numSamples) into output[0 .. numSamples).
+     */
+    static void addResidual (Type* output, const Type height, const Type offset, const int firstSample, const int numSamples) noexcept
+    {
+        assert (offset >= 0 && offset <= 1 && firstSample + numSamples <= length);
+
+        const auto& residual = getResidual();
+        auto position = offset * oversampling;
+        auto row = std::min (static_cast<int> (position), oversampling - 1);
+        auto fraction = position - row;
+
+        const auto* rowA = residual.data() + row * length + firstSample;
+        const auto* rowB = rowA + length;
+
+        for (auto i = 0; i < numSamples; ++i)
+            output[i] += height * (rowA[i] + fraction * (rowB[i] - rowA[i]));
+    }
+
+private:
+    static std::vector<Type> buildResidual()
+    {
+        static constexpr double pi = 3.141592653589793238;
+        auto numPoints = length * oversampling + 1;
+
+        auto order = 1;
+
+        while ((1 << order) < numPoints * 4)
+            ++order;
+
+        FFT<double> fft;
+        fft.prepare (order);
+        auto fftSize = fft.getSize();
+        std::vector<std::complex<double>> buffer (static_cast<size_t> (fftSize));
+
+        // Blackman-windowed sinc, centred in the table
+        for (auto i = 0; i < numPoints; ++i)
+        {
+            auto x = (static_cast<double> (i) / oversampling) - zeroCrossings;
+            auto sinc = x == 0 ? 1.0 : std::sin (pi * x) / (pi * x);
+            auto w = static_cast<double> (i) / (numPoints - 1);
+            auto window = 0.42 - 0.5 * std::cos (2.0 * pi * w) + 0.08 * std::cos (4.0 * pi * w);
+            buffer[static_cast<size_t> (i)] = sinc * window;
+        }
+
+        // Minimum phase through the real cepstrum: log magnitude, fold the cepstrum onto positive time, exp back
+        fft.perform (buffer.data(), false);
+
+        for (auto& bin : buffer)
+            bin = std::log (std::max (std::abs (bin), 1.0e-20));
+
+        fft.perform (buffer.data(), true);
+
+        for (auto i = 1; i < fftSize / 2; ++i)
+            buffer[static_cast<size_t> (i)] *= 2.0;
+
+        for (auto i = fftSize / 2 + 1; i < fftSize; ++i)
+            buffer[static_cast<size_t> (i)] = 0.0;
+
+        fft.perform (buffer.data(), false);
+
+        for (auto& bin : buffer)
+            bin = std::exp (bin);
+
+        fft.perform (buffer.data(), true);
+
+        // Integrate the minimum phase impulse into a step, then normalise it to finish at exactly 1
+        std::vector<double> step (static_cast<size_t> (numPoints));
+        double sum = 0;
+
+        for (auto i = 0; i < numPoints; ++i)
+        {
+            sum += buffer[static_cast<size_t> (i)].real();
+            step[static_cast<size_t> (i)] = sum;
+        }
+
+        // Rearrange into one row per sub-sample offset.  Anything past the end of the table has settled at 1.
+        std::vector<Type> residual (static_cast<size_t> ((oversampling + 1) * length));
+
+        for (auto row = 0; row <= oversampling; ++row)
+        {
+            for (auto i = 0; i < length; ++i)
+            {
+                auto index = static_cast<size_t> (row + i * oversampling);
+                residual[static_cast<size_t> (row * length + i)] = index < step.size() ? static_cast<Type> (step[index] / sum - 1.0) : Type (0);
+            }
+        }
+
+        return residual;
+    }
+};
+
+// =================================================================
+
+/**
+    A hard-synced sawtooth: a slave oscillator whose phase is reset every time a master oscillator completes a cycle.
+    Naive sync aliases badly, and the additive SynthWave can't sync at all, so every jump (sync resets and the slave's
+    own wraps) is smoothed by adding a MinBlep residual at its exact sub-sample position.  The residuals collect in
+    a small ring buffer that's read out one sample at a time.
+ */
+
+template <typename Type>
+class HardSyncOscillator
+{
+public:
+    /** Pass the sample rate to the DSP algorithm*/
+    void prepareToPlay (double& sampleRate) noexcept
+    {
+        currentSampleRate = sampleRate;
+        MinBlep<Type>::getResidual();
+        reset();
+    }
+
+    /** The master sets the pitch you hear */
+    void setMasterFrequency (const Type frequency) noexcept
+    {
+        assert (currentSampleRate > 0 && frequency > 0 && frequency < currentSampleRate / 2);
+        masterIncrement = static_cast<Type> (frequency / currentSampleRate);
+    }
+
+    /** The slave sets the timbre.  Sweeping it above the master gives the classic sync sound. */
+    void setSlaveFrequency (const Type frequency) noexcept
+    {
+        assert (currentSampleRate > 0 && frequency > 0 && frequency < currentSampleRate / 2);
+        slaveIncrement = static_cast<Type> (frequency / currentSampleRate);
+    }
+
+    void reset() noexcept
+    {
+        masterPhase = slavePhase = 0;
+        std::fill (std::begin (residuals), std::end (residuals), Type (0));
+        readIndex = 0;
+    }
+
+    Type process() noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+
+        auto previousSlavePhase = slavePhase;
+        masterPhase += masterIncrement;
+        slavePhase += slaveIncrement;
+
+        if (masterPhase >= 1)
+        {
+            masterPhase -= 1;
+
+            // How long ago, in samples, the master wrapped
+            auto offset = masterPhase / masterIncrement;
+
+            // Where the slave was at that moment.  It may have wrapped on its own before the sync.
+            auto phaseAtSync = previousSlavePhase + slaveIncrement * (1 - offset);
+
+            if (phaseAtSync >= 1)
+            {
+                auto wrapOffset = (previousSlavePhase + slaveIncrement - 1) / slaveIncrement;
+                addStep (-2, wrapOffset);
+                phaseAtSync -= 1;
+            }
+
+            // The output jumps from 2 * phaseAtSync - 1 down to -1 at the sync
+            slavePhase = slaveIncrement * offset;
+            addStep (-2 * phaseAtSync, offset);
+        }
+        else if (slavePhase >= 1)
+        {
+            slavePhase -= 1;
+            addStep (-2, slavePhase / slaveIncrement);
+        }
+
+        auto output = 2 * slavePhase - 1 + residuals[readIndex];
+        residuals[readIndex] = 0;
+        readIndex = (readIndex + 1) & ringMask;
+        return output;
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    static constexpr int ringSize = 2 * MinBlep<Type>::length;
+    static constexpr int ringMask = ringSize - 1;
+
+    double currentSampleRate = 0;
+    Type masterPhase = 0, slavePhase = 0;
+    Type masterIncrement = 0, slaveIncrement = 0;
+
+    Type residuals[ringSize] = {};
+    int readIndex = 0;
+
+    // Adds the residual in at most two contiguous runs, either side of the ring's wrap point
+    void addStep (const Type height, const Type offset) noexcept
+    {
+        auto firstRun = std::min (MinBlep<Type>::length, ringSize - readIndex);
+        MinBlep<Type>::addResidual (residuals + readIndex, height, offset, 0, firstRun);
+        MinBlep<Type>::addResidual (residuals, height, offset, firstRun, MinBlep<Type>::length - firstRun);
+    }
+};
+
+// =================================================================
+
+/**
+    A granular synthesiser that plays short, overlapping grains from a source buffer.
+
+    Grain windows are an AmplitudeFade ramp in then out, from one shared precomputed table.  Pitch is a phase
+    increment like SynthWave uses, and each grain gets its own Panner gains.  Every grain lives in a preallocated
+    structure-of-arrays pool with the active ones packed at the front, so rendering is one loop across all
+    active grains per sample, and nothing is allocated after prepareToPlay().
+ */
+
+template <typename Type>
+class GranularEngine
+{
+public:
+    /** Pass the sample rate to the DSP algorithm and allocate the grain pool */
+    void prepareToPlay (double& sampleRate, const int maxGrainsToUse = 512)
+    {
+        currentSampleRate = sampleRate;
+        maxGrains = maxGrainsToUse;
+
+        position.assign (static_cast<size_t> (maxGrains), Type (0));
+        increment.assign (static_cast<size_t> (maxGrains), Type (0));
+        windowPhase.assign (static_cast<size_t> (maxGrains), Type (0));
+        windowIncrement.assign (static_cast<size_t> (maxGrains), Type (0));
+        leftGain.assign (static_cast<size_t> (maxGrains), Type (0));
+        rightGain.assign (static_cast<size_t> (maxGrains), Type (0));
+
+        numActive = 0;
+        samplesUntilNextGrain = 0;
+        setWindowCurve (windowCurve);
+    }
+
+    /** The audio to take grains from.  The engine doesn't copy it, so keep it alive while the engine plays. */
+    void setSource (const Type* samples, const int numSamples) noexcept
+    {
+        source = samples;
+        sourceLength = numSamples;
+    }
+
+    /** The curve of the grain window's fade in and out, as in AmplitudeFade::buildRamp() */
+    void setWindowCurve (const float curve) noexcept
+    {
+        windowCurve = curve;
+        auto half = windowSize / 2;
+        AmplitudeFade<Type>::fillRamp (window, half, FadeType::In, curve);
+        AmplitudeFade<Type>::fillRamp (window + half, windowSize - half, FadeType::Out, curve);
+        window[windowSize] = 0;
+    }
+
+    /** How many grains to start per second */
+    void setDensity (const Type grainsPerSecond) noexcept
+    {
+        assert (grainsPerSecond > 0);
+        density = grainsPerSecond;
+    }
+
+    void setGrainLength (const Type seconds) noexcept
+    {
+        assert (seconds > 0);
+        grainLength = seconds;
+    }
+
+    /** Where in the source to take grains from (0.0 to 1.0), and how far to randomly stray from it (in seconds) */
+    void setPosition (const Type normalisedPosition, const Type jitterSeconds = 0) noexcept
+    {
+        assert (normalisedPosition >= 0.0 && normalisedPosition <= 1.0);
+        sourcePosition = normalisedPosition;
+        positionJitter = jitterSeconds;
+    }
+
+    /** Grain pitch in semitones, plus a random spread either side */
+    void setPitch (const Type semitones, const Type spreadSemitones = 0) noexcept
+    {
+        pitch = semitones;
+        pitchSpread = spreadSemitones;
+    }
+
+    /** A spread of 0 puts every grain in the centre, 1 scatters them across the whole stereo field */
+    void setPan (const Type spread, const PanningType& type = PanningType::PowerSineLaw) noexcept
+    {
+        assert (spread >= 0.0 && spread <= 1.0);
+        panSpread = spread;
+        panningType = type;
+    }
+
+    void setGain (const Type newGain) noexcept
+    {
+        gain = newGain;
+    }
+
+    int getNumActiveGrains() const noexcept
+    {
+        return numActive;
+    }
+
+    /** Adds the grains into left and right */
+    void process (Type* left, Type* right, const int numSamples) noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+
+        if (source == nullptr || sourceLength < 2)
+            return;
+
+        auto start = 0;
+
+        while (start < numSamples)
+        {
+            if (samplesUntilNextGrain <= 0)
+            {
+                startGrain();
+                samplesUntilNextGrain = std::max (1, static_cast<int> (currentSampleRate / density));
+            }
+
+            auto count = std::min (numSamples - start, samplesUntilNextGrain);
+            renderGrains (left + start, right + start, count);
+            removeFinishedGrains();
+
+            start += count;
+            samplesUntilNextGrain -= count;
+        }
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    static constexpr int windowSize = 1024;
+
+    // One extra zero at the end, so finished grains read silence until they're removed
+    Type window[windowSize + 1] = {};
+
+    double currentSampleRate = 0;
+    const Type* source = nullptr;
+    int sourceLength = 0;
+
+    float windowCurve = 1.0f;
+    Type density = 20, grainLength = 0.1, gain = 0.5;
+    Type sourcePosition = 0, positionJitter = 0;
+    Type pitch = 0, pitchSpread = 0, panSpread = 0;
+    PanningType panningType = PanningType::PowerSineLaw;
+
+    int maxGrains = 0;
+    int numActive = 0;
+    int samplesUntilNextGrain = 0;
+    std::vector<Type> position, increment, windowPhase, windowIncrement, leftGain, rightGain;
+
+    std::minstd_rand random;
+
+    Type getRandom() noexcept
+    {
+        return static_cast<Type> (random() - random.min()) / static_cast<Type> (random.max() - random.min());
+    }
+
+    void startGrain() noexcept
+    {
+        if (numActive >= maxGrains)
+            return;
+
+        auto length = std::max (1.0, grainLength * currentSampleRate);
+        auto semitones = pitch + pitchSpread * (2 * getRandom() - 1);
+        auto grainIncrement = static_cast<Type> (std::pow (2.0, semitones / 12.0));
+
+        // Keep the whole grain inside the source
+        auto span = grainIncrement * length;
+        auto latestStart = sourceLength - 2 - span;
+
+        if (latestStart < 0)
+            return;
+
+        auto startPosition = sourcePosition * (sourceLength - 1) + positionJitter * currentSampleRate * (2 * getRandom() - 1);
+        auto pan = Type (0.5) + panSpread * (getRandom() - Type (0.5));
+
+        auto grain = static_cast<size_t> (numActive++);
+        position[grain]        = static_cast<Type> (std::max (0.0, std::min (static_cast<double> (startPosition), static_cast<double> (latestStart))));
+        increment[grain]       = grainIncrement;
+        windowPhase[grain]     = 0;
+        windowIncrement[grain] = static_cast<Type> (windowSize / length);
+        leftGain[grain]        = gain * Panner<Type>::getGain (panningType, 0, pan);
+        rightGain[grain]       = gain * Panner<Type>::getGain (panningType, 1, pan);
+    }
+
+    void renderGrains (Type* left, Type* right, const int numSamples) noexcept
+    {
+        auto* pos  = position.data();
+        auto* inc  = increment.data();
+        auto* wPos = windowPhase.data();
+        auto* wInc = windowIncrement.data();
+        const auto* lGain = leftGain.data();
+        const auto* rGain = rightGain.data();
+
+        // Finished grains keep running (silently) until the end of this run, so don't let them read past the source
+        auto lastIndex = sourceLength - 2;
+
+        for (auto sample = 0; sample < numSamples; ++sample)
+        {
+            Type sumLeft = 0, sumRight = 0;
+
+            for (auto grain = 0; grain < numActive; ++grain)
+            {
+                auto index = std::min (static_cast<int> (pos[grain]), lastIndex);
+                auto fraction = pos[grain] - index;
+                auto value = source[index] + fraction * (source[index + 1] - source[index]);
+                auto envelope = window[std::min (static_cast<int> (wPos[grain]), windowSize)];
+
+                value *= envelope;
+                sumLeft  += value * lGain[grain];
+                sumRight += value * rGain[grain];
+
+                pos[grain]  += inc[grain];
+                wPos[grain] += wInc[grain];
+            }
+
+            left[sample]  += sumLeft;
+            right[sample] += sumRight;
+        }
+    }
+
+    // Swap finished grains with the last active one, so the active grains stay packed at the front
+    void removeFinishedGrains() noexcept
+    {
+        for (auto grain = 0; grain < numActive;)
+        {
+            if (windowPhase[static_cast<size_t> (grain)] < windowSize)
+            {
+                ++grain;
+                continue;
+            }
+
+            auto last = static_cast<size_t> (--numActive);
+            auto current = static_cast<size_t> (grain);
+            position[current]        = position[last];
+            increment[current]       = increment[last];
+            windowPhase[current]     = windowPhase[last];
+            windowIncrement[current] = windowIncrement[last];
+            leftGain[current]        = leftGain[last];
+            rightGain[current]       = rightGain[last];
+        }
+    }
+};
+
+// =================================================================
+
+/**
+    Sums N mono tracks into a stereo or multichannel bus, with per-track gain, pan, mute and solo.
+
+    Gain and pan changes are ramped across the next block, so they never click.  Each track is added into each
+    bus channel with one multiply-add loop, and muted tracks (or tracks you pass in as nullptr because they're
+    silent) are skipped entirely once they've faded out.
+
+    For a stereo bus, pan uses the same laws as Panner.  For wider buses, set each track's channel gains directly.
+ */
+
+template <typename Type>
+class Mixer
+{
+public:
+    /** Allocate state for every track.  Call this off the audio thread. */
+    void prepare (const int numTracksToUse, const int numBusChannelsToUse)
+    {
+        // Too many channels for an AudioBlock!
+        assert (numBusChannelsToUse > 0 && numBusChannelsToUse <= AudioBlock<Type>::maxChannels);
+
+        numTracks = numTracksToUse;
+        numBusChannels = numBusChannelsToUse;
+        tracks.assign (static_cast<size_t> (numTracks), Track());
+
+        for (auto& track : tracks)
+            track.channelGains.assign (static_cast<size_t> (numBusChannels), Type (1));
+
+        currentGains.assign (static_cast<size_t> (numTracks * numBusChannels), Type (0));
+        updateTargets();
+    }
+
+    void setTrackGain (const int track, const Type gain) noexcept
+    {
+        getTrack (track).gain = gain;
+    }
+
+    /** Stereo buses only.  Expects 0.0 (left) to 1.0 (right), like Panner. */
+    void setTrackPan (const int track, const Type pan, const PanningType& type = PanningType::PowerSineLaw) noexcept
+    {
+        // Only works for a stereo bus
+        assert (numBusChannels == 2);
+        assert (pan >= 0.0 && pan <= 1.0);
+
+        auto& t = getTrack (track);
+        t.channelGains[0] = Panner<Type>::getGain (type, 0, pan);
+        t.channelGains[1] = Panner<Type>::getGain (type, 1, pan);
+    }
+
+    /** Set how much of a track goes to one bus channel, for buses wider than stereo */
+    void setTrackChannelGain (const int track, const int channel, const Type gain) noexcept
+    {
+        assert (channel >= 0 && channel < numBusChannels);
+        getTrack (track).channelGains[static_cast<size_t> (channel)] = gain;
+    }
+
+    void setTrackMute (const int track, const bool shouldBeMuted) noexcept
+    {
+        getTrack (track).muted = shouldBeMuted;
+    }
+
+    void setTrackSolo (const int track, const bool shouldBeSoloed) noexcept
+    {
+        getTrack (track).soloed = shouldBeSoloed;
+    }
+
+    /** Mixes one block.  trackInputs holds one pointer per track, where nullptr means the track is silent this block.
+        The bus is overwritten, not added to.
+     */
+    void process (const Type* const* trackInputs, AudioBlock<Type>& bus) noexcept
+    {
+        assert (bus.getNumChannels() == numBusChannels);
+
+        updateTargets();
+        bus.clear();
+
+        auto numSamples = bus.getNumSamples();
+        auto rampScale = Type (1) / static_cast<Type> (std::max (1, numSamples));
+
+        for (auto track = 0; track < numTracks; ++track)
+        {
+            const auto* input = trackInputs[track];
+            auto& t = tracks[static_cast<size_t> (track)];
+            auto* current = currentGains.data() + track * numBusChannels;
+
+            for (auto channel = 0; channel < numBusChannels; ++channel)
+            {
+                auto start = current[channel];
+                auto target = t.targetGains[static_cast<size_t> (channel)];
+                current[channel] = target;
+
+                if (input == nullptr || (start == 0 && target == 0))
+                    continue;
+
+                auto* output = bus.getChannelPointer (channel);
+
+                if (start == target)
+                {
+                    for (auto sample = 0; sample < numSamples; ++sample)
+                        output[sample] += input[sample] * target;
+                }
+                else
+                {
+                    auto step = (target - start) * rampScale;
+
+                    for (auto sample = 0; sample < numSamples; ++sample)
+                        output[sample] += input[sample] * (start + step * static_cast<Type> (sample + 1));
+                }
+            }
+        }
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    struct Track
+    {
+        Type gain = 1;
+        bool muted = false;
+        bool soloed = false;
+        std::vector<Type> channelGains;
+        std::vector<Type> targetGains;
+    };
+
+    int numTracks = 0;
+    int numBusChannels = 0;
+    std::vector<Track> tracks;
+    std::vector<Type> currentGains;
+
+    Track& getTrack (const int track) noexcept
+    {
+        assert (track >= 0 && track < numTracks);
+        return tracks[static_cast<size_t> (track)];
+    }
+
+    void updateTargets() noexcept
+    {
+        auto anySoloed = std::any_of (tracks.begin(), tracks.end(), [] (const Track& t) { return t.soloed; });
+
+        for (auto& t : tracks)
+        {
+            auto audible = ! t.muted && (t.soloed || ! anySoloed);
+            t.targetGains.resize (t.channelGains.size());
+
+            for (size_t channel = 0; channel < t.channelGains.size(); ++channel)
+                t.targetGains[channel] = audible ? t.gain * t.channelGains[channel] : Type (0);
+        }
+    }
+};
+
+// =================================================================
+
+/**
+    Reads headerless samples of Type from a file, for use as a StreamingSampler reader.
+    Returns the number of frames actually read.
+ */
+
+template <typename Type>
+std::function<int (Type*, long long, int)> makeRawFileReader (const std::string& path)
+{
+    auto stream = std::make_shared<std::ifstream> (path, std::ios::binary);
+
+    return [stream] (Type* destination, const long long startFrame, const int numFrames)
+    {
+        stream->clear();
+        stream->seekg (static_cast<std::streamoff> (startFrame * static_cast<long long> (sizeof (Type))));
+        stream->read (reinterpret_cast<char*> (destination), static_cast<std::streamsize> (numFrames * sizeof (Type)));
+        return static_cast<int> (stream->gcount() / static_cast<std::streamsize> (sizeof (Type)));
+    };
+}
+
+// =================================================================
+
+/**
+    A sample player for libraries too big to keep in memory.  Only the first few milliseconds (the "head") of each
+    sample are loaded into RAM.  When a voice starts, it plays from the head straight away while a background I/O
+    thread streams the rest from disk into that voice's lock-free ring buffer, topping it up as the voice plays.
+    The audio thread never touches the disk.
+
+    Voices are resampled with 4-point Hermite interpolation, so they can be pitched.
+
+    Each voice moves through Free -> Starting -> Streaming -> Stopping -> Free, and each state has one owner:
+    the audio thread only sets up a voice while it's Free, and the I/O thread only writes to its ring while it's
+    Starting or Streaming, so the ring never needs a lock.
+ */
+
+template <typename Type>
+class StreamingSampler
+{
+public:
+    /** Reads numFrames mono frames starting at startFrame into destination, returning how many were read.  Only ever called on the I/O thread. */
+    using ReadFunction = std::function<int (Type* destination, long long startFrame, int numFrames)>;
+
+    ~StreamingSampler()
+    {
+        stopThread();
+    }
+
+    /** Adds a sample and preloads its head.  Call this before prepareToPlay(), off the audio thread.
+        If the reader comes up short, the sample is treated as ending there instead of at lengthInFrames.
+     */
+    int addSample (ReadFunction reader, const long long lengthInFrames, const double sourceSampleRate, const double preloadMilliseconds = 500.0)
+    {
+        assert (reader != nullptr);
+        assert (lengthInFrames >= 0 && sourceSampleRate > 0);
+
+        auto sample = std::make_unique<Sample>();
+        sample->reader = std::move (reader);
+        sample->length = lengthInFrames;
+        sample->sampleRate = sourceSampleRate;
+
+        auto headLength = static_cast<int> (std::min<long long> (lengthInFrames, static_cast<long long> (preloadMilliseconds * sourceSampleRate / 1000.0)));
+        sample->head.resize (static_cast<size_t> (headLength));
+        auto numRead = std::max (0, sample->reader (sample->head.data(), 0, headLength));
+
+        // The file is shorter than we were told (or couldn't be read), so it ends where the head does
+        if (numRead < headLength)
+            sample->length = numRead;
+
+        sample->head.resize (static_cast<size_t> (numRead));
+
+        samples.push_back (std::move (sample));
+        return static_cast<int> (samples.size()) - 1;
+    }
+
+    /** Pass the sample rate to the DSP algorithm, allocate the voices and start the I/O thread.
+        ringSize is how many frames each voice buffers ahead, and should be a power of 2.
+     */
+    void prepareToPlay (double& sampleRate, const int numVoices = 32, const int ringSize = 32768)
+    {
+        assert (ringSize > 0 && (ringSize & (ringSize - 1)) == 0);
+
+        stopThread();
+        currentSampleRate = sampleRate;
+
+        voices.clear();
+
+        for (auto i = 0; i < numVoices; ++i)
+        {
+            voices.push_back (std::make_unique<Voice>());
+            voices.back()->ring.assign (static_cast<size_t> (ringSize), Type (0));
+        }
+
+        running.store (true);
+        ioThread = std::thread ([this] { runIO(); });
+    }
+
+    /** Start a sample on a free voice.  Returns the voice index, or -1 if every voice is busy. */
+    int startVoice (const int sampleIndex, const Type semitones = 0, const Type gain = 1) noexcept
+    {
+        assert (sampleIndex >= 0 && sampleIndex < static_cast<int> (samples.size()));
+
+        for (size_t i = 0; i < voices.size(); ++i)
+        {
+            auto& voice = *voices[i];
+
+            if (voice.state.load (std::memory_order_acquire) != VoiceState::Free)
+                continue;
+
+            const auto& sample = *samples[static_cast<size_t> (sampleIndex)];
+
+            voice.sample = &sample;
+            voice.gain = gain;
+            voice.rate = static_cast<Type> (std::pow (2.0, semitones / 12.0) * sample.sampleRate / currentSampleRate);
+            voice.streamPosition = static_cast<long long> (sample.head.size());
+            voice.readPosition = 0;
+            voice.endFrame.store (sample.length, std::memory_order_relaxed);
+            voice.fraction = 0;
+            voice.writeCount.store (0, std::memory_order_relaxed);
+            voice.readCount.store (0, std::memory_order_relaxed);
+            std::fill (std::begin (voice.history), std::end (voice.history), Type (0));
+
+            // Prime the interpolator with the first three frames
+            for (auto j = 0; j < 3; ++j)
+                pushHistory (voice, readNextFrame (voice));
+
+            voice.state.store (VoiceState::Starting, std::memory_order_release);
+            return static_cast<int> (i);
+        }
+
+        return -1;
+    }
+
+    void stopVoice (const int voiceIndex) noexcept
+    {
+        auto& voice = *voices[static_cast<size_t> (voiceIndex)];
+        auto state = voice.state.load (std::memory_order_acquire);
+
+        if (state == VoiceState::Starting || state == VoiceState::Streaming)
+            voice.state.store (VoiceState::Stopping, std::memory_order_release);
+    }
+
+    /** Adds every playing voice into output */
+    void process (Type* output, const int numSamples) noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+
+        for (size_t i = 0; i < voices.size(); ++i)
+        {
+            auto& voice = *voices[i];
+            auto state = voice.state.load (std::memory_order_acquire);
+
+            if (state != VoiceState::Starting && state != VoiceState::Streaming)
+                continue;
+
+            for (auto sample = 0; sample < numSamples; ++sample)
+            {
+                const auto* h = voice.history;
+                auto t = voice.fraction;
+
+                // 4-point, 3rd-order Hermite
+                auto c1 = Type (0.5) * (h[2] - h[0]);
+                auto c2 = h[0] - Type (2.5) * h[1] + Type (2) * h[2] - Type (0.5) * h[3];
+                auto c3 = Type (0.5) * (h[3] - h[0]) + Type (1.5) * (h[1] - h[2]);
+                output[sample] += voice.gain * (((c3 * t + c2) * t + c1) * t + h[1]);
+
+                voice.fraction += voice.rate;
+
+                while (voice.fraction >= 1)
+                {
+                    voice.fraction -= 1;
+                    pushHistory (voice, readNextFrame (voice));
+                }
+
+                if (voice.readPosition > voice.endFrame.load (std::memory_order_acquire) + 2)
+                {
+                    voice.state.store (VoiceState::Stopping, std::memory_order_release);
+                    break;
+                }
+            }
+        }
+    }
+
+    /** How many source frames voices have had to wait for because the I/O thread fell behind.  A voice plays silence
+        while it waits and then carries on from where it stopped.  If this goes up, use bigger heads or rings.
+     */
+    int getNumUnderruns() const noexcept
+    {
+        return underruns.load();
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    enum class VoiceState
+    {
+        Free,
+        Starting,
+        Streaming,
+        Stopping
+    };
+
+    struct Sample
+    {
+        ReadFunction reader;
+        std::vector<Type> head;
+        long long length = 0;
+        double sampleRate = 0;
+    };
+
+    struct Voice
+    {
+        std::atomic<VoiceState> state { VoiceState::Free };
+
+        // Owned by the audio thread
+        const Sample* sample = nullptr;
+        Type gain = 1, rate = 1, fraction = 0;
+        Type history[4] = {};
+        long long readPosition = 0;
+
+        // Owned by the I/O thread once the voice has started
+        long long streamPosition = 0;
+
+        // Where the voice's audio ends: set from the sample's length when it starts, and pulled in by the
+        // I/O thread if the reader comes up short, so a truncated file doesn't leave the voice waiting forever
+        std::atomic<long long> endFrame { 0 };
+
+        std::vector<Type> ring;
+        std::atomic<size_t> writeCount { 0 };
+        std::atomic<size_t> readCount { 0 };
+    };
+
+    static constexpr int readChunkSize = 4096;
+
+    double currentSampleRate = 0;
+    std::vector<std::unique_ptr<Sample>> samples;
+    std::vector<std::unique_ptr<Voice>> voices;
+    std::atomic<int> underruns { 0 };
+    std::atomic<bool> running { false };
+    std::thread ioThread;
+
+    static void pushHistory (Voice& voice, const Type frame) noexcept
+    {
+        voice.history[0] = voice.history[1];
+        voice.history[1] = voice.history[2];
+        voice.history[2] = voice.history[3];
+        voice.history[3] = frame;
+    }
+
+    /** Audio thread: the next source frame, from the head if we're still in it, otherwise from the ring */
+    Type readNextFrame (Voice& voice) noexcept
+    {
+        auto position = voice.readPosition;
+        const auto& head = voice.sample->head;
+
+        if (position < static_cast<long long> (head.size()))
+        {
+            ++voice.readPosition;
+            return head[static_cast<size_t> (position)];
+        }
+
+        auto read = voice.readCount.load (std::memory_order_relaxed);
+
+        if (read != voice.writeCount.load (std::memory_order_acquire))
+        {
+            auto frame = voice.ring[read & (voice.ring.size() - 1)];
+            voice.readCount.store (read + 1, std::memory_order_release);
+            ++voice.readPosition;
+            return frame;
+        }
+
+        // Past the end, so keep counting until process() notices and stops the voice
+        if (position >= voice.endFrame.load (std::memory_order_acquire))
+        {
+            ++voice.readPosition;
+            return 0;
+        }
+
+        // Underrun.  Don't move the read position, so it stays locked to the next frame the I/O thread delivers.
+        underruns++;
+        return 0;
+    }
+
+    void stopThread()
+    {
+        running.store (false);
+
+        if (ioThread.joinable())
+            ioThread.join();
+    }
+
+    void runIO()
+    {
+        std::vector<Type> chunk (static_cast<size_t> (readChunkSize));
+
+        while (running.load())
+        {
+            auto didWork = false;
+
+            for (auto& voicePointer : voices)
+            {
+                auto& voice = *voicePointer;
+                auto state = voice.state.load (std::memory_order_acquire);
+
+                if (state == VoiceState::Stopping)
+                {
+                    voice.state.store (VoiceState::Free, std::memory_order_release);
+                    continue;
+                }
+
+                if (state == VoiceState::Starting)
+                {
+                    // Only move on if the audio thread hasn't stopped the voice in the meantime
+                    auto expected = VoiceState::Starting;
+                    voice.state.compare_exchange_strong (expected, VoiceState::Streaming);
+                }
+                else if (state != VoiceState::Streaming)
+                {
+                    continue;
+                }
+
+                const auto& sample = *voice.sample;
+                auto capacity = voice.ring.size();
+                auto write = voice.writeCount.load (std::memory_order_relaxed);
+                auto space = capacity - (write - voice.readCount.load (std::memory_order_acquire));
+                auto remaining = voice.endFrame.load (std::memory_order_relaxed) - voice.streamPosition;
+
+                // Top up in chunks, as the voice's position frees up space
+                if (remaining <= 0 || (space < static_cast<size_t> (readChunkSize) && static_cast<long long> (space) < remaining))
+                    continue;
+
+                auto numToRead = static_cast<int> (std::min<long long> ({ static_cast<long long> (space), remaining, static_cast<long long> (readChunkSize) }));
+                auto numRead = std::max (0, sample.reader (chunk.data(), voice.streamPosition, numToRead));
+
+                for (auto i = 0; i < numRead; ++i)
+                    voice.ring[(write + static_cast<size_t> (i)) & (capacity - 1)] = chunk[static_cast<size_t> (i)];
+
+                voice.streamPosition += numRead;
+                voice.writeCount.store (write + static_cast<size_t> (numRead), std::memory_order_release);
+
+                // A short read (or an error) is the end of the stream, so let the voice finish there
+                if (numRead < numToRead)
+                    voice.endFrame.store (voice.streamPosition, std::memory_order_release);
+
+                didWork = didWork || numRead > 0;
+            }
+
+            if (! didWork)
+                std::this_thread::sleep_for (std::chrono::milliseconds (1));
+        }
+    }
+};
+
+// =================================================================
+
+/**
+    A sample-accurate automation lane.  Each breakpoint sets the curve of the segment that starts at it, using the
+    same curve as AmplitudeFade::buildRamp, so automation and fades bend the same way.
+
+    Rendering finds the starting segment with a binary search, so seeking anywhere costs O(log n).  Inside a segment
+    the curve's exponential is stepped with a single multiply per sample instead of calling std::exp.
+ */
+
+template <typename Type>
+class AutomationLane
+{
+public:
+    /** Adds a breakpoint, keeping the lane sorted.  Adding one at an existing position replaces it.  Not real time safe. */
+    void addBreakpoint (const long long position, const Type value, const float curve = 1.0f)
+    {
+        Breakpoint breakpoint;
+        breakpoint.position = position;
+        breakpoint.value = value;
+        breakpoint.curve = curve == 0.0f ? 0.1f : curve; // Prevent division by 0, like AmplitudeFade
+
+        auto it = std::lower_bound (breakpoints.begin(), breakpoints.end(), position,
+                                    [] (const Breakpoint& b, const long long p) { return b.position < p; });
+
+        if (it != breakpoints.end() && it->position == position)
+            *it = breakpoint;
+        else
+            breakpoints.insert (it, breakpoint);
+
+        updateSegments();
+    }
+
+    void removeBreakpoint (const int index)
+    {
+        assert (index >= 0 && index < getNumBreakpoints());
+
+        breakpoints.erase (breakpoints.begin() + index);
+        updateSegments();
+    }
+
+    void clear() noexcept
+    {
+        breakpoints.clear();
+    }
+
+    int getNumBreakpoints() const noexcept
+    {
+        return static_cast<int> (breakpoints.size());
+    }
+
+    /** The value before the first breakpoint, or everywhere if the lane is empty */
+    void setDefaultValue (const Type value) noexcept
+    {
+        defaultValue = value;
+    }
+
+    /** Random access to a single sample, O(log n) */
+    Type getValueAt (const long long position) const noexcept
+    {
+        auto index = findSegment (position);
+
+        if (index < 0)
+            return breakpoints.empty() ? defaultValue : breakpoints.front().value;
+
+        const auto& segment = breakpoints[static_cast<size_t> (index)];
+
+        if (segment.length == 0)
+            return segment.value;
+
+        auto x = static_cast<double> (position - segment.position) / static_cast<double> (segment.length);
+        return getSegmentValue (segment, std::exp (segment.curve * x));
+    }
+
+    /** Renders numSamples values starting at startPosition, e.g. for the block an offline render is working on */
+    void render (Type* destination, const long long startPosition, const int numSamples) const noexcept
+    {
+        auto index = findSegment (startPosition);
+        auto position = startPosition;
+        auto sample = 0;
+
+        // Before the first breakpoint
+        if (index < 0)
+        {
+            auto value = breakpoints.empty() ? defaultValue : breakpoints.front().value;
+            auto numBefore = breakpoints.empty() ? static_cast<long long> (numSamples)
+                                                 : std::min<long long> (numSamples, breakpoints.front().position - startPosition);
+
+            for (; sample < numBefore; ++sample)
+                destination[sample] = value;
+
+            position += numBefore;
+            index = 0;
+        }
+
+        while (sample < numSamples)
+        {
+            const auto& segment = breakpoints[static_cast<size_t> (index)];
+
+            // After the last breakpoint the value holds
+            if (segment.length == 0)
+            {
+                for (; sample < numSamples; ++sample)
+                    destination[sample] = segment.value;
+
+                return;
+            }
+
+            auto segmentEnd = segment.position + segment.length;
+            auto numInSegment = static_cast<int> (std::min<long long> (numSamples - sample, segmentEnd - position));
+
+            // Seek once, then step the exponential by multiplying
+            auto exponential = std::exp (segment.curve * static_cast<double> (position - segment.position) / static_cast<double> (segment.length));
+
+            for (auto i = 0; i < numInSegment; ++i)
+            {
+                destination[sample + i] = getSegmentValue (segment, exponential);
+                exponential *= segment.step;
+            }
+
+            sample += numInSegment;
+            position += numInSegment;
+            ++index;
+        }
+    }
+
+private:
+    struct Breakpoint
+    {
+        long long position = 0;
+        Type value = 0;
+        float curve = 1.0f;
+
+        // Cached for the segment between this breakpoint and the next
+        long long length = 0;
+        Type range = 0;
+        double step = 1, normalise = 1;
+    };
+
+    std::vector<Breakpoint> breakpoints;
+    Type defaultValue = 0;
+
+    void updateSegments() noexcept
+    {
+        for (size_t i = 0; i < breakpoints.size(); ++i)
+        {
+            auto& b = breakpoints[i];
+
+            if (i + 1 == breakpoints.size())
+            {
+                b.length = 0;
+                continue;
+            }
+
+            b.length = breakpoints[i + 1].position - b.position;
+            b.range = breakpoints[i + 1].value - b.value;
+            b.step = std::exp (static_cast<double> (b.curve) / static_cast<double> (b.length));
+            b.normalise = 1.0 / (std::exp (static_cast<double> (b.curve)) - 1.0);
+        }
+    }
+
+    /** Index of the segment containing position, or -1 if it's before the first breakpoint */
+    int findSegment (const long long position) const noexcept
+    {
+        auto it = std::upper_bound (breakpoints.begin(), breakpoints.end(), position,
+                                    [] (const long long p, const Breakpoint& b) { return p < b.position; });
+
+        return static_cast<int> (it - breakpoints.begin()) - 1;
+    }
+
+    static Type getSegmentValue (const Breakpoint& segment, const double exponential) noexcept
+    {
+        return segment.value + segment.range * static_cast<Type> ((exponential - 1.0) * segment.normalise);
+    }
+};
+
+// =================================================================
+
+enum class SampleFormat
+{
+    Int16,
+    Int24,      // Packed, 3 bytes per sample
+    Int32
+};
+
+enum class NoiseShaping
+{
+    None,
+    FirstOrder,     // Pushes the noise up with a simple differentiator
+    SecondOrder,
+    Lipshitz        // 5 tap psychoacoustic curve from Lipshitz, Vanderkooy & Wannamaker, "Minimally Audible Noise Shaping"
+};
+
+/**
+    Converts between floating point blocks and interleaved little-endian integer audio (at any alignment), e.g. at the I/O boundary
+    of an offline render.  This is the same quantisation Distortion::processBitCrush does, but at a fixed word length
+    and with optional TPDF dither and noise shaping.
+
+    With dither and noise shaping both off, conversion takes a fast clamp-and-round path written so the compiler
+    can vectorise it.  Noise shaping feeds the quantisation error back through a short filter, so it has to run
+    sample by sample.
+ */
+
+template <typename Type>
+class SampleFormatConverter
+{
+public:
+    void prepare (const int numChannels, const int maximumBlockSize)
+    {
+        assert (numChannels > 0 && numChannels <= AudioBlock<Type>::maxChannels);
+
+        errors.assign (static_cast<size_t> (numChannels), ErrorHistory {});
+        scratch.assign (static_cast<size_t> (maximumBlockSize), 0);
+    }
+
+    void setFormat (const SampleFormat& newFormat) noexcept
+    {
+        format = newFormat;
+    }
+
+    int getBytesPerSample() const noexcept
+    {
+        return format == SampleFormat::Int16 ? 2 : (format == SampleFormat::Int24 ? 3 : 4);
+    }
+
+    /** Adds triangular (TPDF) dither of +/- 1 LSB before quantising */
+    void setDither (const bool shouldDither) noexcept
+    {
+        dither = shouldDither;
+    }
+
+    void setNoiseShaping (const NoiseShaping& type)
+    {
+        switch (type)
+        {
+            case NoiseShaping::None:        setNoiseShaping (std::vector<double>()); break;
+            case NoiseShaping::FirstOrder:  setNoiseShaping ({ 1.0 }); break;
+            case NoiseShaping::SecondOrder: setNoiseShaping ({ 2.0, -1.0 }); break;
+            case NoiseShaping::Lipshitz:    setNoiseShaping ({ 2.033, -2.165, 1.959, -1.590, 0.6149 }); break;
+        }
+    }
+
+    /** Use your own error feedback filter.  coefficients[0] applies to the previous sample's error. */
+    void setNoiseShaping (const std::vector<double>& coefficients)
+    {
+        // Too many taps!
+        assert (coefficients.size() <= static_cast<size_t> (maxShapingOrder));
+
+        shapingOrder = static_cast<int> (coefficients.size());
+        std::fill (std::begin (shaping), std::end (shaping), 0.0);
+        std::copy (coefficients.begin(), coefficients.end(), std::begin (shaping));
+    }
+
+    void reset() noexcept
+    {
+        for (auto& error : errors)
+            error = ErrorHistory {};
+    }
+
+    /** Quantises and interleaves input into destination, which must hold numChannels * numSamples * getBytesPerSample() bytes */
+    void write (const AudioBlock<Type>& input, void* destination) noexcept
+    {
+        // You must call prepare() with enough channels and a big enough block size
+        assert (input.getNumChannels() <= static_cast<int> (errors.size()));
+        assert (input.getNumSamples() <= static_cast<int> (scratch.size()));
+
+        auto numChannels = input.getNumChannels();
+        auto numSamples = input.getNumSamples();
+        auto* bytes = static_cast<uint8_t*> (destination);
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+        {
+            if (dither || shapingOrder > 0)
+                quantiseShaped (input.getChannelPointer (channel), numSamples, errors[static_cast<size_t> (channel)]);
+            else
+                quantiseFast (input.getChannelPointer (channel), numSamples);
+
+            const auto* q = scratch.data();
+
+            switch (format)
+            {
+                case SampleFormat::Int16:
+                {
+                    auto* out = bytes + 2 * channel;
+
+                    for (auto i = 0; i < numSamples; ++i)
+                    {
+                        auto value = static_cast<uint32_t> (q[i]);
+                        auto* frame = out + 2 * i * numChannels;
+                        frame[0] = static_cast<uint8_t> (value);
+                        frame[1] = static_cast<uint8_t> (value >> 8);
+                    }
+
+                    break;
+                }
+                case SampleFormat::Int24:
+                {
+                    auto* out = bytes + 3 * channel;
+
+                    for (auto i = 0; i < numSamples; ++i)
+                    {
+                        auto value = static_cast<uint32_t> (q[i]);
+                        auto* frame = out + 3 * i * numChannels;
+                        frame[0] = static_cast<uint8_t> (value);
+                        frame[1] = static_cast<uint8_t> (value >> 8);
+                        frame[2] = static_cast<uint8_t> (value >> 16);
+                    }
+
+                    break;
+                }
+                case SampleFormat::Int32:
+                {
+                    auto* out = bytes + 4 * channel;
+
+                    for (auto i = 0; i < numSamples; ++i)
+                    {
+                        auto value = static_cast<uint32_t> (q[i]);
+                        auto* frame = out + 4 * i * numChannels;
+                        frame[0] = static_cast<uint8_t> (value);
+                        frame[1] = static_cast<uint8_t> (value >> 8);
+                        frame[2] = static_cast<uint8_t> (value >> 16);
+                        frame[3] = static_cast<uint8_t> (value >> 24);
+                    }
+
+                    break;
+                }
+            }
+        }
+    }
+
+    /** De-interleaves source into output, scaling back to -1 to 1 */
+    void read (const void* source, AudioBlock<Type>& output) const noexcept
+    {
+        auto numChannels = output.getNumChannels();
+        auto numSamples = output.getNumSamples();
+        const auto* bytes = static_cast<const uint8_t*> (source);
+        const auto scale = static_cast<Type> (1.0 / getFullScale());
+
+        for (auto channel = 0; channel < numChannels; ++channel)
+        {
+            auto* out = output.getChannelPointer (channel);
+
+            switch (format)
+            {
+                case SampleFormat::Int16:
+                {
+                    const auto* in = bytes + 2 * channel;
+
+                    for (auto i = 0; i < numSamples; ++i)
+                    {
+                        const auto* frame = in + 2 * i * numChannels;
+                        auto value = static_cast<uint16_t> (frame[0] | (frame[1] << 8));
+                        out[i] = static_cast<Type> (static_cast<int16_t> (value)) * scale;
+                    }
+
+                    break;
+                }
+                case SampleFormat::Int24:
+                {
+                    const auto* in = bytes + 3 * channel;
+
+                    for (auto i = 0; i < numSamples; ++i)
+                    {
+                        const auto* frame = in + 3 * i * numChannels;
+                        auto value = static_cast<uint32_t> (frame[0]) | (static_cast<uint32_t> (frame[1]) << 8) | (static_cast<uint32_t> (frame[2]) << 16);
+
+                        // Sign extend from 24 bits
+                        out[i] = static_cast<Type> (static_cast<int32_t> (value << 8) >> 8) * scale;
+                    }
+
+                    break;
+                }
+                case SampleFormat::Int32:
+                {
+                    const auto* in = bytes + 4 * channel;
+
+                    for (auto i = 0; i < numSamples; ++i)
+                    {
+                        const auto* frame = in + 4 * i * numChannels;
+                        auto value = static_cast<uint32_t> (frame[0]) | (static_cast<uint32_t> (frame[1]) << 8)
+                                   | (static_cast<uint32_t> (frame[2]) << 16) | (static_cast<uint32_t> (frame[3]) << 24);
+                        out[i] = static_cast<Type> (static_cast<int32_t> (value)) * scale;
+                    }
+
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr int maxShapingOrder = 8;
+
+    struct ErrorHistory
+    {
+        double error[maxShapingOrder] = {};
+    };
+
+    SampleFormat format = SampleFormat::Int24;
+    bool dither = false;
+    int shapingOrder = 0;
+    double shaping[maxShapingOrder] = {};
+
+    std::vector<ErrorHistory> errors;
+    std::vector<int32_t> scratch;
+    uint32_t randomState = 22222;
+
+    double getFullScale() const noexcept
+    {
+        return format == SampleFormat::Int16 ? 32768.0 : (format == SampleFormat::Int24 ? 8388608.0 : 2147483648.0);
+    }
+
+    /** Clamp and round with no branches in the loop, so it vectorises */
+    void quantiseFast (const Type* input, const int numSamples) noexcept
+    {
+        const auto fullScale = getFullScale();
+        const auto scale = static_cast<Type> (fullScale);
+        const auto lower = static_cast<Type> (-fullScale);
+
+        // The largest value that still fits once it's been rounded (float can't hold 2^31 - 1)
+        const auto upper = std::min (static_cast<Type> (fullScale - 1.0), std::nextafter (scale, Type (0)));
+        auto* q = scratch.data();
+
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            auto x = std::min (std::max (input[i] * scale, lower), upper);
+            q[i] = static_cast<int32_t> (x + (x < 0 ? Type (-0.5) : Type (0.5)));
+        }
+    }
+
+    void quantiseShaped (const Type* input, const int numSamples, ErrorHistory& history) noexcept
+    {
+        const auto fullScale = getFullScale();
+        auto* q = scratch.data();
+        auto* e = history.error;
+
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            auto shaped = static_cast<double> (input[i]) * fullScale;
+
+            for (auto k = 0; k < shapingOrder; ++k)
+                shaped -= shaping[k] * e[k];
+
+            auto noise = dither ? getNextRandom() - getNextRandom() : 0.0;
+            auto rounded = std::floor (shaped + noise + 0.5);
+
+            for (auto k = maxShapingOrder - 1; k > 0; --k)
+                e[k] = e[k - 1];
+
+            // Leave clipping out of the feedback, otherwise one clipped sample can make the filter unstable
+            e[0] = rounded - shaped;
+            q[i] = static_cast<int32_t> (std::min (std::max (rounded, -fullScale), fullScale - 1.0));
+        }
+    }
+
+    /** Uniform between 0 and 1, from a cheap LCG */
+    double getNextRandom() noexcept
+    {
+        randomState = randomState * 1664525u + 1013904223u;
+        return static_cast<double> (randomState) * (1.0 / 4294967296.0);
+    }
+};
+
+// =================================================================
+
+enum class ChannelLayout
+{
+    Mono,           // M
+    Stereo,         // L R
+    LCR,            // L R C
+    Surround51,     // L R C LFE Ls Rs
+    Surround71,     // L R C LFE Lss Rss Lrs Rrs
+    Surround714     // L R C LFE Lss Rss Lrs Rrs Ltf Rtf Ltr Rtr
+};
+
+/**
+    Up-mixes or down-mixes between channel layouts, for example to make stereo and mono deliverables from a 7.1.4 master.
+
+    Down-mixing folds each layout into the next smaller one (7.1.4 -> 7.1 -> 5.1 -> LCR -> stereo -> mono) with the
+    ITU-R BS.775 style -3 dB coefficients, so 5.1 to stereo gives the familiar L + 0.707 C + 0.707 Ls.  The LFE is
+    dropped unless you give it a gain.  Up-mixing is a plain passive route: channels go to the same speakers in the
+    bigger layout, and mono goes to the centre when there is one.
+
+    The steps are multiplied out when you set the layouts, and only the non-zero coefficients are kept, so process()
+    does a few whole-block multiply-adds per output channel.
+ */
+
+template <typename Type>
+class ChannelLayoutConverter
+{
+public:
+    static int getNumChannels (const ChannelLayout& layout) noexcept
+    {
+        switch (layout)
+        {
+            case ChannelLayout::Mono:           return 1;
+            case ChannelLayout::Stereo:         return 2;
+            case ChannelLayout::LCR:            return 3;
+            case ChannelLayout::Surround51:     return 6;
+            case ChannelLayout::Surround71:     return 8;
+            case ChannelLayout::Surround714:    return 12;
+        }
+
+        return 0;
+    }
+
+    /** How much of the LFE to fold into the centre when down-mixing from 5.1 or bigger.  0 drops it, as ITU does. */
+    void setLfeGain (const Type gain)
+    {
+        lfeGain = gain;
+        setLayouts (inputLayout, outputLayout);
+    }
+
+    /** Builds the matrix.  Not real time safe. */
+    void setLayouts (const ChannelLayout& input, const ChannelLayout& output)
+    {
+        inputLayout = input;
+        outputLayout = output;
+
+        auto matrix = getIdentity (getNumChannels (input));
+        auto layout = input;
+
+        // Mono has nowhere else to go but the centre
+        if (layout == ChannelLayout::Mono && output > ChannelLayout::Stereo)
+        {
+            Matrix step (3, std::vector<double> (1, 0.0));
+            step[2][0] = 1.0;
+            matrix = multiply (step, matrix);
+            layout = ChannelLayout::LCR;
+        }
+
+        while (layout != output)
+        {
+            auto next = static_cast<ChannelLayout> (static_cast<int> (layout) + (output > layout ? 1 : -1));
+            matrix = multiply (output > layout ? getUpStep (layout) : getDownStep (layout), matrix);
+            layout = next;
+        }
+
+        gains.clear();
+
+        for (size_t out = 0; out < matrix.size(); ++out)
+            for (size_t in = 0; in < matrix[out].size(); ++in)
+                if (matrix[out][in] != 0.0)
+                    gains.push_back ({ static_cast<int> (out), static_cast<int> (in), static_cast<Type> (matrix[out][in]) });
+    }
+
+    /** The coefficient from an input channel to an output channel */
+    Type getGain (const int outputChannel, const int inputChannel) const noexcept
+    {
+        for (const auto& gain : gains)
+            if (gain.output == outputChannel && gain.input == inputChannel)
+                return gain.gain;
+
+        return 0;
+    }
+
+    /** Mixes input into output.  They must be separate blocks with the same number of samples. */
+    void process (const AudioBlock<Type>& input, AudioBlock<Type>& output) const noexcept
+    {
+        // Your blocks don't match the layouts you set!
+        assert (input.getNumChannels() == getNumChannels (inputLayout));
+        assert (output.getNumChannels() == getNumChannels (outputLayout));
+        assert (input.getNumSamples() == output.getNumSamples());
+
+        auto numSamples = output.getNumSamples();
+        auto entry = gains.begin();
+
+        for (auto channel = 0; channel < output.getNumChannels(); ++channel)
+        {
+            auto* out = output.getChannelPointer (channel);
+
+            // Gains are sorted by output, so the first one for this channel overwrites and the rest accumulate
+            if (entry == gains.end() || entry->output != channel)
+            {
+                std::fill (out, out + numSamples, Type (0));
+                continue;
+            }
+
+            const auto* in = input.getChannelPointer (entry->input);
+            const auto gain = entry->gain;
+
+            if (gain == Type (1))
+                std::copy (in, in + numSamples, out);
+            else
+                for (auto i = 0; i < numSamples; ++i)
+                    out[i] = gain * in[i];
+
+            for (++entry; entry != gains.end() && entry->output == channel; ++entry)
+            {
+                const auto* source = input.getChannelPointer (entry->input);
+                const auto g = entry->gain;
+
+                for (auto i = 0; i < numSamples; ++i)
+                    out[i] += g * source[i];
+            }
+        }
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    using Matrix = std::vector<std::vector<double>>;
+
+    struct Gain
+    {
+        int output, input;
+        Type gain;
+    };
+
+    static constexpr double minus3dB = 0.7071067811865476;
+
+    ChannelLayout inputLayout = ChannelLayout::Stereo, outputLayout = ChannelLayout::Stereo;
+    Type lfeGain = 0;
+    std::vector<Gain> gains { { 0, 0, Type (1) }, { 1, 1, Type (1) } };
+
+    static Matrix getIdentity (const int numChannels)
+    {
+        Matrix matrix (static_cast<size_t> (numChannels), std::vector<double> (static_cast<size_t> (numChannels), 0.0));
+
+        for (auto i = 0; i < numChannels; ++i)
+            matrix[static_cast<size_t> (i)][static_cast<size_t> (i)] = 1.0;
+
+        return matrix;
+    }
+
+    /** An identity matrix resized to numOutputs x numInputs, i.e. channels that exist in both layouts pass straight through */
+    static Matrix getPassThrough (const int numOutputs, const int numInputs)
+    {
+        Matrix matrix (static_cast<size_t> (numOutputs), std::vector<double> (static_cast<size_t> (numInputs), 0.0));
+
+        for (auto i = 0; i < std::min (numOutputs, numInputs); ++i)
+            matrix[static_cast<size_t> (i)][static_cast<size_t> (i)] = 1.0;
+
+        return matrix;
+    }
+
+    static Matrix multiply (const Matrix& a, const Matrix& b)
+    {
+        Matrix result (a.size(), std::vector<double> (b.front().size(), 0.0));
+
+        for (size_t row = 0; row < a.size(); ++row)
+            for (size_t k = 0; k < b.size(); ++k)
+                for (size_t column = 0; column < b[k].size(); ++column)
+                    result[row][column] += a[row][k] * b[k][column];
+
+        return result;
+    }
+
+    /** Folds a layout into the next smaller one */
+    Matrix getDownStep (const ChannelLayout& layout) const
+    {
+        auto next = static_cast<ChannelLayout> (static_cast<int> (layout) - 1);
+        auto step = getPassThrough (getNumChannels (next), getNumChannels (layout));
+
+        switch (layout)
+        {
+            case ChannelLayout::Surround714:
+                // Tops fold into the ear-level speaker below them
+                step[0][8] = minus3dB;      // Ltf -> L
+                step[1][9] = minus3dB;      // Rtf -> R
+                step[6][10] = minus3dB;     // Ltr -> Lrs
+                step[7][11] = minus3dB;     // Rtr -> Rrs
+                break;
+
+            case ChannelLayout::Surround71:
+                step[4][4] = minus3dB;      // Lss -> Ls
+                step[5][5] = minus3dB;      // Rss -> Rs
+                step[4][6] = minus3dB;      // Lrs -> Ls
+                step[5][7] = minus3dB;      // Rrs -> Rs
+                break;
+
+            case ChannelLayout::Surround51:
+                step[0][4] = minus3dB;      // Ls -> L
+                step[1][5] = minus3dB;      // Rs -> R
+                step[2][3] = static_cast<double> (lfeGain);    // LFE -> C
+                break;
+
+            case ChannelLayout::LCR:
+                step[0][2] = minus3dB;      // C -> L
+                step[1][2] = minus3dB;      // C -> R
+                break;
+
+            case ChannelLayout::Stereo:
+                step[0][0] = minus3dB;
+                step[0][1] = minus3dB;
+                break;
+
+            case ChannelLayout::Mono:
+                // Nothing smaller than mono
+                assert (false);
+                break;
+        }
+
+        return step;
+    }
+
+    /** Routes a layout into the next bigger one */
+    static Matrix getUpStep (const ChannelLayout& layout)
+    {
+        auto next = static_cast<ChannelLayout> (static_cast<int> (layout) + 1);
+        auto step = getPassThrough (getNumChannels (next), getNumChannels (layout));
+
+        if (layout == ChannelLayout::Mono)
+        {
+            step[0][0] = minus3dB;
+            step[1][0] = minus3dB;
+        }
+
+        // 5.1 surrounds become the 7.1 sides
+        if (layout == ChannelLayout::Surround51)
+        {
+            step[4][4] = 1.0;
+            step[5][5] = 1.0;
+        }
+
+        return step;
+    }
+};
+
+// =================================================================
+
+/**
+    Splits an offline render of one long timeline into chunks and renders them on separate threads.
+
+    Each worker builds its own copy of the chain with the factory you give it, then renders whole chunks with it,
+    seeking the chain to the start of each chunk first.  As long as everything in the chain can seek exactly
+    (SynthWave, Tremolo and AmplitudeFade all can), every chunk starts in the same state a single threaded render
+    would have reached, so the stitched result is bit-exact.  Recursive processors like filters and delays can't
+    do that, so keep them out of chunked chains.
+ */
+
+template <typename Type>
+class ChunkedRenderer
+{
+public:
+    /** Renders block, which starts at startSample on the timeline.  It should seek its chain to startSample first. */
+    using RenderFunction = std::function<void (AudioBlock<Type>& block, long long startSample)>;
+
+    /** Called once per worker thread to build a private chain, returning the function that renders with it */
+    using ChainFactory = std::function<RenderFunction()>;
+
+    void setChainFactory (ChainFactory factory)
+    {
+        chainFactory = std::move (factory);
+    }
+
+    void setChunkSize (const int numSamples) noexcept
+    {
+        assert (numSamples > 0);
+        chunkSize = numSamples;
+    }
+
+    /** Renders the whole of output, which starts at startSample on the timeline.  A numThreads of 0 uses one worker per hardware thread. */
+    void render (AudioBlock<Type>& output, const long long startSample = 0, int numThreads = 0)
+    {
+        // You need to give the renderer a way to make chains
+        assert (chainFactory != nullptr);
+
+        auto numChunks = (output.getNumSamples() + chunkSize - 1) / chunkSize;
+
+        if (numThreads <= 0)
+            numThreads = static_cast<int> (std::max (1u, std::thread::hardware_concurrency()));
+
+        numThreads = std::max (1, std::min (numThreads, numChunks));
+
+        std::atomic<int> nextChunk { 0 };
+        std::vector<std::thread> workers;
+
+        auto renderChunks = [&]
+        {
+            auto renderChunk = chainFactory();
+
+            for (auto chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++)
+            {
+                auto start = chunk * chunkSize;
+                auto block = output.getSubBlock (start, std::min (chunkSize, output.getNumSamples() - start));
+                renderChunk (block, startSample + start);
+            }
+        };
+
+        for (auto i = 1; i < numThreads; ++i)
+            workers.emplace_back (renderChunks);
+
+        // The calling thread does its share too
+        renderChunks();
+
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+private:
+    ChainFactory chainFactory;
+    int chunkSize = 65536;
+};
+
+// =================================================================
+
+enum class FdnMatrix
+{
+    Hadamard,       // Mixes every line with every other line, the densest tail
+    Householder     // Reflects around the mean, a little less dense but cheaper
+};
+
+/**
+    A feedback delay network reverb.  8 or 16 delay lines feed back into each other through a lossless mixing matrix,
+    with a one-pole low-pass in each loop so the highs die away first, like a real room.
+
+    All the lines live in one block of memory with a shared power-of-two length, so every line uses the same write
+    position and a mask for wrapping.  Line state is kept as arrays across lines, and the Hadamard matrix is done
+    with log2 (numLines) stages of add/subtract butterflies, so each per-sample step is a short loop over the lines
+    that the compiler can vectorise.  Input channel c feeds lines c, c + numChannels, c + 2 * numChannels...,
+    and the same lines make up output channel c.
+ */
+
+template <typename Type>
+class FdnReverb : public BlockProcessor<Type>
+{
+public:
+    /** 8 or 16.  Call before prepare(). */
+    void setNumLines (const int newNumLines) noexcept
+    {
+        assert (newNumLines == 8 || newNumLines == 16);
+        numLines = newNumLines;
+    }
+
+    void setMatrix (const FdnMatrix& type) noexcept
+    {
+        matrix = type;
+    }
+
+    /** Scales the delay lengths, between 0.1 and 1 */
+    void setRoomSize (const Type size) noexcept
+    {
+        assert (size >= Type (0.1) && size <= Type (1));
+        roomSize = size;
+        updateLines();
+    }
+
+    /** The time in seconds for the tail to fall by 60 dB */
+    void setDecayTime (const Type seconds) noexcept
+    {
+        assert (seconds > 0);
+        decayTime = seconds;
+        updateLines();
+    }
+
+    /** 0 leaves the tail bright, towards 1 darkens it */
+    void setDamping (const Type amount) noexcept
+    {
+        assert (amount >= 0 && amount < 1);
+        damping = amount;
+    }
+
+    /** 0 is all dry, 1 is all wet (e.g. on a send) */
+    void setMix (const Type wetAmount) noexcept
+    {
+        mix = wetAmount;
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        // Each output channel needs at least one line
+        assert (spec.numChannels > 0 && spec.numChannels <= numLines);
+
+        sampleRate = spec.sampleRate;
+
+        auto longest = static_cast<int> (std::ceil (maxDelayMilliseconds * sampleRate / 1000.0)) + 1;
+        bufferSize = 1;
+
+        while (bufferSize < longest)
+            bufferSize <<= 1;
+
+        lines.assign (static_cast<size_t> (numLines * bufferSize), Type (0));
+        updateLines();
+        reset();
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        // You must call prepare() first
+        assert (! lines.empty());
+
+        auto numChannels = block.getNumChannels();
+        auto numSamples = block.getNumSamples();
+        const auto mask = bufferSize - 1;
+        const auto inputGain = Type (1) / std::sqrt (static_cast<Type> (numLines) / static_cast<Type> (numChannels));
+        const auto outputGain = inputGain;
+        const auto hadamardScale = Type (1) / std::sqrt (static_cast<Type> (numLines));
+        const auto householderScale = Type (2) / static_cast<Type> (numLines);
+
+        Type v[maxLines];
+        Type wet[AudioBlock<Type>::maxChannels];
+
+        for (auto sample = 0; sample < numSamples; ++sample)
+        {
+            // Read every line
+            for (auto i = 0; i < numLines; ++i)
+                v[i] = lines[static_cast<size_t> (i * bufferSize + ((writeIndex - delays[i]) & mask))];
+
+            for (auto channel = 0; channel < numChannels; ++channel)
+            {
+                wet[channel] = 0;
+
+                for (auto i = channel; i < numLines; i += numChannels)
+                    wet[channel] += v[i];
+            }
+
+            // Damping and decay
+            for (auto i = 0; i < numLines; ++i)
+            {
+                lowpass[i] = v[i] + damping * (lowpass[i] - v[i]);
+                v[i] = lowpass[i] * gains[i];
+            }
+
+            if (matrix == FdnMatrix::Hadamard)
+            {
+                for (auto width = 1; width < numLines; width <<= 1)
+                {
+                    for (auto start = 0; start < numLines; start += 2 * width)
+                    {
+                        for (auto i = start; i < start + width; ++i)
+                        {
+                            auto a = v[i];
+                            auto b = v[i + width];
+                            v[i] = a + b;
+                            v[i + width] = a - b;
+                        }
+                    }
+                }
+
+                for (auto i = 0; i < numLines; ++i)
+                    v[i] *= hadamardScale;
+            }
+            else
+            {
+                Type sum = 0;
+
+                for (auto i = 0; i < numLines; ++i)
+                    sum += v[i];
+
+                sum *= householderScale;
+
+                for (auto i = 0; i < numLines; ++i)
+                    v[i] -= sum;
+            }
+
+            // Feed the input in and write back
+            for (auto channel = 0; channel < numChannels; ++channel)
+            {
+                auto* data = block.getChannelPointer (channel);
+                auto input = data[sample];
+
+                for (auto i = channel; i < numLines; i += numChannels)
+                    v[i] += input * inputGain;
+
+                data[sample] = input * (1 - mix) + wet[channel] * outputGain * mix;
+            }
+
+            for (auto i = 0; i < numLines; ++i)
+                lines[static_cast<size_t> (i * bufferSize + writeIndex)] = v[i];
+
+            writeIndex = (writeIndex + 1) & mask;
+        }
+    }
+
+    void reset() override
+    {
+        std::fill (lines.begin(), lines.end(), Type (0));
+        std::fill (std::begin (lowpass), std::end (lowpass), Type (0));
+        writeIndex = 0;
+    }
+
+private:
+    static constexpr int maxLines = 16;
+    static constexpr double minDelayMilliseconds = 23.0;
+    static constexpr double maxDelayMilliseconds = 97.0;
+
+    int numLines = 8;
+    FdnMatrix matrix = FdnMatrix::Hadamard;
+    Type roomSize = 1, decayTime = 2, damping = Type (0.3), mix = 1;
+
+    double sampleRate = 0;
+    int bufferSize = 0;
+    int writeIndex = 0;
+    std::vector<Type> lines;
+
+    int delays[maxLines] = {};
+    Type gains[maxLines] = {};
+    Type lowpass[maxLines] = {};
+
+    /** Spreads the delays exponentially so their echoes don't line up, and sets each line's loss for the decay time */
+    void updateLines() noexcept
+    {
+        if (sampleRate <= 0)
+            return;
+
+        for (auto i = 0; i < numLines; ++i)
+        {
+            auto milliseconds = minDelayMilliseconds * std::pow (maxDelayMilliseconds / minDelayMilliseconds,
+                                                                 static_cast<double> (i) / (numLines - 1));
+
+            // Odd lengths avoid the most obvious common factors
+            delays[i] = std::max (1, static_cast<int> (milliseconds * static_cast<double> (roomSize) * sampleRate / 1000.0) | 1);
+            gains[i] = static_cast<Type> (std::pow (10.0, -3.0 * delays[i] / (static_cast<double> (decayTime) * sampleRate)));
+        }
+    }
+};
+
+// =================================================================
+
+enum class StringExcitation
+{
+    Noise,      // The classic Karplus-Strong pluck
+    Impulse     // One period of SynthWave's band-limited impulse train, a softer, rounder attack
+};
+
+/**
+    A bank of Karplus-Strong plucked strings.  Each string is a delay line with a loss filter (a weighted two-point
+    average scaled by the decay) and a first-order allpass in the loop.  The allpass takes up the fractional part of
+    the period, so strings stay in tune instead of snapping to whole-sample delays.
+
+    Every string's delay line lives in one shared arena with the same power-of-two length and write position, and
+    the per-string state is kept as arrays, so each sample is one pass over all the strings in a loop the compiler
+    can vectorise.
+ */
+
+template <typename Type>
+class StringBank
+{
+public:
+    /** Pass the sample rate to the DSP algorithm and allocate the strings.  lowestFrequency sets the longest delay. */
+    void prepareToPlay (double& sampleRate, const int numberOfStrings, const Type lowestFrequency = 20)
+    {
+        assert (numberOfStrings > 0 && lowestFrequency > 0);
+
+        currentSampleRate = sampleRate;
+        numStrings = numberOfStrings;
+
+        auto longest = static_cast<int> (std::ceil (sampleRate / lowestFrequency)) + 2;
+        lineSize = 1;
+
+        while (lineSize < longest)
+            lineSize <<= 1;
+
+        arena.assign (static_cast<size_t> (numStrings * lineSize), Type (0));
+        excitationBuffer.assign (static_cast<size_t> (lineSize), Type (0));
+
+        auto size = static_cast<size_t> (numStrings);
+        delays.assign (size, 1);
+        frequencies.assign (size, Type (440));
+        decayTimes.assign (size, Type (2));
+        brightness.assign (size, Type (0.5));
+        loopGains.assign (size, Type (0));
+        averages.assign (size, Type (0.5));
+        allpassCoefficients.assign (size, Type (0));
+        previousInputs.assign (size, Type (0));
+        allpassInputs.assign (size, Type (0));
+        allpassOutputs.assign (size, Type (0));
+        writeIndex = 0;
+    }
+
+    /** The time in seconds for a string to fall by 60 dB */
+    void setDecay (const int string, const Type seconds) noexcept
+    {
+        assert (seconds > 0);
+        decayTimes[static_cast<size_t> (string)] = seconds;
+        updateString (string);
+    }
+
+    /** 0 gives the darkest string, 1 no loss filtering at all */
+    void setBrightness (const int string, const Type amount) noexcept
+    {
+        assert (amount >= 0 && amount <= 1);
+        brightness[static_cast<size_t> (string)] = amount;
+        updateString (string);
+    }
+
+    /** Tunes a string and fills its delay line with the excitation.  Nothing is allocated, so it's safe to call from the audio thread. */
+    void pluck (const int string, const Type frequency, const Type velocity = 1, const StringExcitation& excitation = StringExcitation::Noise) noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+        assert (string >= 0 && string < numStrings);
+
+        auto index = static_cast<size_t> (string);
+        frequencies[index] = frequency;
+        updateString (string);
+
+        auto length = delays[index];
+        auto* line = arena.data() + index * static_cast<size_t> (lineSize);
+        auto burst = excitationBuffer.begin();
+        auto burstEnd = burst + length;
+
+        if (excitation == StringExcitation::Noise)
+        {
+            std::uniform_real_distribution<float> distribution (-1.0f, 1.0f);
+
+            for (auto it = burst; it != burstEnd; ++it)
+                *it = static_cast<Type> (distribution (random));
+        }
+        else
+        {
+            // SynthWave::processImpulseTrain sums a sine per harmonic, which gets slow for low strings, so use the
+            // closed form of the same sum: sin(kx) for k = 1..M is sin(Mx/2) sin((M+1)x/2) / sin(x/2)
+            auto maxHarmonic = std::floor (currentSampleRate / (2.0 * static_cast<double> (frequency)));
+            auto step = 3.141592653589793 * static_cast<double> (frequency) / currentSampleRate;
+
+            for (auto it = burst; it != burstEnd; ++it)
+            {
+                auto halfPhase = step * static_cast<double> (it - burst);
+                auto denominator = std::sin (halfPhase);
+
+                // The sum is 0 wherever sin(x/2) is, so there's nothing to add
+                *it = std::abs (denominator) < 1.0e-12 ? Type (0)
+                    : static_cast<Type> (std::sin (maxHarmonic * halfPhase) * std::sin ((maxHarmonic + 1.0) * halfPhase) / denominator);
+            }
+        }
+
+        // Remove DC so it doesn't hang around in the loop, and normalise
+        auto mean = std::accumulate (burst, burstEnd, Type (0)) / static_cast<Type> (length);
+        Type peak = 0;
+
+        for (auto it = burst; it != burstEnd; ++it)
+        {
+            *it -= mean;
+            peak = std::max (peak, std::abs (*it));
+        }
+
+        auto scale = peak > 0 ? velocity / peak : Type (0);
+
+        // The samples the loop is about to read
+        for (auto i = 0; i < length; ++i)
+            line[(writeIndex - length + i) & (lineSize - 1)] = burst[i] * scale;
+
+        previousInputs[index] = 0;
+        allpassInputs[index] = 0;
+        allpassOutputs[index] = 0;
+    }
+
+    /** Silences a string straight away */
+    void mute (const int string) noexcept
+    {
+        auto* line = arena.data() + static_cast<size_t> (string) * static_cast<size_t> (lineSize);
+        std::fill (line, line + lineSize, Type (0));
+        previousInputs[static_cast<size_t> (string)] = 0;
+        allpassInputs[static_cast<size_t> (string)] = 0;
+        allpassOutputs[static_cast<size_t> (string)] = 0;
+    }
+
+    /** Adds the sum of every string into output */
+    void process (Type* output, const int numSamples) noexcept
+    {
+        const auto mask = lineSize - 1;
+        auto* line = arena.data();
+        const auto* d = delays.data();
+        const auto* g = loopGains.data();
+        const auto* a = averages.data();
+        const auto* c = allpassCoefficients.data();
+        auto* previous = previousInputs.data();
+        auto* apIn = allpassInputs.data();
+        auto* apOut = allpassOutputs.data();
+
+        for (auto sample = 0; sample < numSamples; ++sample)
+        {
+            Type sum = 0;
+
+            for (auto s = 0; s < numStrings; ++s)
+            {
+                auto offset = s * lineSize;
+                auto x = line[offset + ((writeIndex - d[s]) & mask)];
+
+                // Loss filter
+                auto lossy = g[s] * ((1 - a[s]) * x + a[s] * previous[s]);
+                previous[s] = x;
+
+                // Fractional delay allpass
+                auto y = c[s] * lossy + apIn[s] - c[s] * apOut[s];
+                apIn[s] = lossy;
+                apOut[s] = y;
+
+                line[offset + writeIndex] = y;
+                sum += y;
+            }
+
+            output[sample] += sum;
+            writeIndex = (writeIndex + 1) & mask;
+        }
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    double currentSampleRate = 0;
+    int numStrings = 0;
+    int lineSize = 0;
+    int writeIndex = 0;
+    std::vector<Type> arena;
+
+    // Scratch space for building an excitation, so pluck() doesn't allocate
+    std::vector<Type> excitationBuffer;
+
+    std::vector<int> delays;
+    std::vector<Type> frequencies, decayTimes, brightness;
+    std::vector<Type> loopGains, averages, allpassCoefficients;
+    std::vector<Type> previousInputs, allpassInputs, allpassOutputs;
+
+    std::minstd_rand random;
+
+    /** Splits the period into whole samples plus an allpass delay between 0.5 and 1.5 samples, where it's most accurate */
+    void updateString (const int string) noexcept
+    {
+        if (currentSampleRate <= 0)
+            return;
+
+        auto index = static_cast<size_t> (string);
+        auto frequency = static_cast<double> (frequencies[index]);
+        auto average = 0.5 * (1.0 - static_cast<double> (brightness[index]));
+        auto omega = 2.0 * 3.141592653589793 * frequency / currentSampleRate;
+
+        // The loss filter's phase delay at the string's frequency, which is only exactly 'average' at DC
+        auto lossDelay = std::atan2 (average * std::sin (omega), 1.0 - average + average * std::cos (omega)) / omega;
+
+        auto period = currentSampleRate / frequency;
+        auto whole = std::max (1, static_cast<int> (std::floor (period - lossDelay - 0.5)));
+        whole = std::min (whole, lineSize - 1);
+        auto fraction = period - lossDelay - whole;
+
+        delays[index] = whole;
+        averages[index] = static_cast<Type> (average);
+
+        // Allpass coefficient for an exact phase delay of 'fraction' at the string's frequency
+        allpassCoefficients[index] = static_cast<Type> (std::sin (0.5 * omega * (1.0 - fraction)) / std::sin (0.5 * omega * (1.0 + fraction)));
+        loopGains[index] = static_cast<Type> (std::pow (10.0, -3.0 / (static_cast<double> (decayTimes[index]) * frequency)));
+    }
+};
+
+// =================================================================
+
+/**
+    A bank of damped sinusoidal modes for modal synthesis, e.g. bells, bars, plates and impacts.  Each mode is a
+    complex one-pole: every sample its state is multiplied by r * e^(j * omega), which rings at omega and decays by r,
+    so a mode costs one complex multiply per sample rather than a std::sin.
+
+    Frequencies, decays and gains only take effect at the start of the next process() call, so drive them from a
+    ControlRateScheduler.  The state carries over, so retuning a ringing mode doesn't click.  Modes are stored as
+    arrays padded to whole batches of batchLaneWidth, and each sample sums all of them in one pass.
+ */
+
+template <typename Type>
+class ModalBank
+{
+public:
+    /** Pass the sample rate to the DSP algorithm and allocate the modes */
+    void prepareToPlay (double& sampleRate, const int numberOfModes)
+    {
+        assert (numberOfModes > 0);
+
+        currentSampleRate = sampleRate;
+        numModes = numberOfModes;
+
+        auto padded = static_cast<size_t> ((numModes + batchLaneWidth - 1) / batchLaneWidth * batchLaneWidth);
+        frequencies.assign (padded, Type (440));
+        decayTimes.assign (padded, Type (1));
+        gains.assign (padded, Type (0));
+        realCoefficients.assign (padded, Type (0));
+        imagCoefficients.assign (padded, Type (0));
+        inputGains.assign (padded, Type (0));
+        realState.assign (padded, Type (0));
+        imagState.assign (padded, Type (0));
+        needsUpdate = true;
+    }
+
+    /** Sets a mode's frequency in Hz, the time in seconds for it to fall by 60 dB, and its level */
+    void setMode (const int mode, const Type frequency, const Type decayTime, const Type gain) noexcept
+    {
+        assert (mode >= 0 && mode < numModes);
+        assert (decayTime > 0);
+
+        auto index = static_cast<size_t> (mode);
+        frequencies[index] = frequency;
+        decayTimes[index] = decayTime;
+        gains[index] = gain;
+        needsUpdate = true;
+    }
+
+    /** Sets every mode from a fundamental and lists of frequency ratios, decay times and gains, e.g. from a measured bell */
+    void setModes (const Type fundamental, const std::vector<Type>& ratios, const std::vector<Type>& modeDecayTimes, const std::vector<Type>& modeGains) noexcept
+    {
+        assert (ratios.size() == modeDecayTimes.size() && ratios.size() == modeGains.size());
+
+        auto count = std::min (numModes, static_cast<int> (ratios.size()));
+
+        for (auto mode = 0; mode < count; ++mode)
+            setMode (mode, fundamental * ratios[static_cast<size_t> (mode)], modeDecayTimes[static_cast<size_t> (mode)], modeGains[static_cast<size_t> (mode)]);
+    }
+
+    /** Hits every mode with an impulse */
+    void strike (const Type velocity) noexcept
+    {
+        updateCoefficients();
+
+        for (size_t i = 0; i < realState.size(); ++i)
+            realState[i] += velocity * inputGains[i];
+    }
+
+    void reset() noexcept
+    {
+        std::fill (realState.begin(), realState.end(), Type (0));
+        std::fill (imagState.begin(), imagState.end(), Type (0));
+    }
+
+    /** Excites the modes with input (which can be nullptr to just let them ring) and adds their sum into output */
+    void process (const Type* input, Type* output, const int numSamples) noexcept
+    {
+        // You must set your sample rate in prepareToPlay
+        assert (currentSampleRate > 0);
+
+        updateCoefficients();
+
+        auto numLanes = static_cast<int> (realState.size());
+        auto* re = realState.data();
+        auto* im = imagState.data();
+        const auto* cr = realCoefficients.data();
+        const auto* ci = imagCoefficients.data();
+        const auto* g = inputGains.data();
+
+        for (auto sample = 0; sample < numSamples; ++sample)
+        {
+            auto excitation = input != nullptr ? input[sample] : Type (0);
+            Type laneSums[batchLaneWidth] = {};
+
+            for (auto chunk = 0; chunk < numLanes; chunk += batchLaneWidth)
+            {
+                for (auto lane = 0; lane < batchLaneWidth; ++lane)
+                {
+                    auto i = chunk + lane;
+                    auto r = re[i] * cr[i] - im[i] * ci[i] + excitation * g[i];
+                    auto j = re[i] * ci[i] + im[i] * cr[i];
+                    re[i] = r;
+                    im[i] = j;
+                    laneSums[lane] += j;
+                }
+            }
+
+            Type sum = 0;
+
+            for (auto lane = 0; lane < batchLaneWidth; ++lane)
+                sum += laneSums[lane];
+
+            output[sample] += sum;
+        }
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+private:
+    double currentSampleRate = 0;
+    int numModes = 0;
+    bool needsUpdate = false;
+
+    std::vector<Type> frequencies, decayTimes, gains;
+    std::vector<Type> realCoefficients, imagCoefficients, inputGains;
+    std::vector<Type> realState, imagState;
+
+    /** Only redoes the trig when a mode has changed.  Padding lanes keep zero coefficients and stay silent. */
+    void updateCoefficients() noexcept
+    {
+        if (! needsUpdate)
+            return;
+
+        needsUpdate = false;
+        auto nyquist = currentSampleRate / 2.0;
+
+        for (auto mode = 0; mode < numModes; ++mode)
+        {
+            auto index = static_cast<size_t> (mode);
+            auto frequency = static_cast<double> (frequencies[index]);
+
+            // Modes above Nyquist would alias, so mute them
+            if (frequency <= 0 || frequency >= nyquist)
+            {
+                realCoefficients[index] = imagCoefficients[index] = inputGains[index] = 0;
+                continue;
+            }
+
+            auto radius = std::pow (10.0, -3.0 / (static_cast<double> (decayTimes[index]) * currentSampleRate));
+            auto omega = 2.0 * 3.141592653589793 * frequency / currentSampleRate;
+
+            realCoefficients[index] = static_cast<Type> (radius * std::cos (omega));
+            imagCoefficients[index] = static_cast<Type> (radius * std::sin (omega));
+            inputGains[index] = gains[index];
+        }
+    }
+};
+
+// =================================================================
+
+enum class StretchMode
+{
+    PhaseVocoder,   // Best for polyphonic and tonal material, can smear transients
+    Wsola           // Waveform similarity overlap-add, keeps transients crisp, best for speech and drums
+};
+
+/**
+    Offline time-stretching and pitch-shifting, e.g. for tempo-conforming a sample library.
+
+    Pitch shifting stretches by the pitch ratio as well and then resamples the result with Hermite interpolation,
+    so both modes share one engine.  Analysis frames are centred on their hop positions, so the output stays lined
+    up with the input and there's no latency to compensate for.
+
+    The output is cut into segments that overlap by one frame, and the segments of every channel are rendered on
+    separate threads.  Each segment warms up on a few frames before its start, then the overlaps are crossfaded
+    together.  Channels are stretched independently.
+ */
+
+template <typename Type>
+class TimeStretcher
+{
+public:
+    void setMode (const StretchMode& newMode) noexcept
+    {
+        mode = newMode;
+    }
+
+    /** How much longer the output is than the input, e.g. 2 for half speed */
+    void setStretch (const Type ratio) noexcept
+    {
+        assert (ratio > 0);
+        stretch = ratio;
+    }
+
+    void setPitch (const Type semitones) noexcept
+    {
+        pitchRatio = std::pow (Type (2), semitones / Type (12));
+    }
+
+    /** Frames are 2 ^ order samples long.  Longer frames suit low, slow material. */
+    void setFrameOrder (const int order) noexcept
+    {
+        assert (order >= 8 && order <= 16);
+        frameOrder = order;
+    }
+
+    /** How many output samples each thread renders at a time */
+    void setSegmentLength (const int numSamples) noexcept
+    {
+        assert (numSamples > 0);
+        segmentLength = numSamples;
+    }
+
+    int getOutputLength (const int inputLength) const noexcept
+    {
+        return static_cast<int> (std::llround (static_cast<double> (inputLength) * stretch));
+    }
+
+    /** The output starts in line with the input, so there's nothing to compensate for */
+    int getLatencySamples() const noexcept
+    {
+        return 0;
+    }
+
+    /** Renders the whole of input into output, which must have the same number of channels and getOutputLength() samples.
+        A numThreads of 0 uses one worker per hardware thread.
+     */
+    void process (const AudioBlock<Type>& input, AudioBlock<Type>& output, int numThreads = 0)
+    {
+        assert (input.getNumChannels() == output.getNumChannels());
+        assert (output.getNumSamples() == getOutputLength (input.getNumSamples()));
+
+        fft.prepare (frameOrder);
+        frameSize = 1 << frameOrder;
+        window.resize (static_cast<size_t> (frameSize));
+
+        for (auto i = 0; i < frameSize; ++i)
+            window[static_cast<size_t> (i)] = static_cast<Type> (0.5 - 0.5 * std::cos (2.0 * pi * i / frameSize));
+
+        auto numChannels = output.getNumChannels();
+        auto totalLength = output.getNumSamples();
+        auto overlap = frameSize;
+        auto numSegments = std::max (1, (totalLength + segmentLength - 1) / segmentLength);
+        auto numTasks = numChannels * numSegments;
+
+        // WSOLA segments each lock on to their own waveform alignment, so they're rendered with some slack either
+        // side and slid into line with the previous segment when stitching.  Phase vocoder segments already agree.
+        auto margin = mode == StretchMode::Wsola ? frameSize / 8 : 0;
+
+        std::vector<std::vector<Type>> results (static_cast<size_t> (numTasks));
+
+        if (numThreads <= 0)
+            numThreads = static_cast<int> (std::max (1u, std::thread::hardware_concurrency()));
+
+        numThreads = std::max (1, std::min (numThreads, numTasks));
+
+        std::atomic<int> nextTask { 0 };
+        std::vector<std::thread> workers;
+
+        auto renderTasks = [&]
+        {
+            for (auto task = nextTask++; task < numTasks; task = nextTask++)
+            {
+                auto channel = task / numSegments;
+                auto start = (task % numSegments) * segmentLength;
+                auto end = std::min (totalLength, start + segmentLength + overlap);
+                auto& result = results[static_cast<size_t> (task)];
+
+                result.assign (static_cast<size_t> (end - start + 2 * margin), Type (0));
+                renderRange (input.getChannelPointer (channel), input.getNumSamples(), result.data(), start - margin, end - start + 2 * margin);
+            }
+        };
+
+        for (auto i = 1; i < numThreads; ++i)
+            workers.emplace_back (renderTasks);
+
+        renderTasks();
+
+        for (auto& worker : workers)
+            worker.join();
+
+        // Stitch the segments back together, crossfading where they overlap
+        for (auto task = 0; task < numTasks; ++task)
+        {
+            auto* out = output.getChannelPointer (task / numSegments);
+            auto segment = task % numSegments;
+            auto start = segment * segmentLength;
+            const auto& result = results[static_cast<size_t> (task)];
+            auto length = static_cast<int> (result.size()) - 2 * margin;
+            auto fadeLength = std::min (overlap, length);
+            auto shift = 0;
+
+            if (segment > 0 && margin > 0)
+            {
+                auto bestScore = -std::numeric_limits<double>::infinity();
+
+                for (auto offset = -margin; offset <= margin; ++offset)
+                {
+                    double product = 0, energy = 1.0e-12;
+
+                    for (auto i = 0; i < fadeLength; ++i)
+                    {
+                        auto value = static_cast<double> (result[static_cast<size_t> (i + margin + offset)]);
+                        product += static_cast<double> (out[start + i]) * value;
+                        energy += value * value;
+                    }
+
+                    auto score = product / std::sqrt (energy);
+
+                    if (score > bestScore)
+                    {
+                        bestScore = score;
+                        shift = offset;
+                    }
+                }
+            }
+
+            for (auto i = 0; i < length; ++i)
+            {
+                auto value = result[static_cast<size_t> (i + margin + shift)];
+
+                if (segment > 0 && i < fadeLength)
+                {
+                    auto fade = (static_cast<Type> (i) + Type (0.5)) / static_cast<Type> (fadeLength);
+                    out[start + i] = out[start + i] * (1 - fade) + value * fade;
+                }
+                else
+                {
+                    out[start + i] = value;
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr double pi = 3.141592653589793238;
+    static constexpr int warmUpFrames = 8;
+
+    StretchMode mode = StretchMode::PhaseVocoder;
+    Type stretch = 1, pitchRatio = 1;
+    int frameOrder = 11;
+    int frameSize = 0;
+    int segmentLength = 1 << 18;
+
+    FFT<Type> fft;
+    std::vector<Type> window;
+
+    /** Renders output samples [start, start + numSamples) of the stretched and pitch shifted channel.  Safe to call from several threads at once. */
+    void renderRange (const Type* input, const int inputLength, Type* destination, const long long start, const int numSamples) const
+    {
+        if (numSamples <= 0)
+            return;
+
+        if (pitchRatio == Type (1))
+        {
+            renderStretched (input, inputLength, destination, start, numSamples, static_cast<double> (stretch));
+            return;
+        }
+
+        // Stretch by the pitch ratio too, then read it back faster or slower to put the length right
+        auto ratio = static_cast<double> (pitchRatio);
+        auto first = static_cast<long long> (std::floor (static_cast<double> (start) * ratio)) - 2;
+        auto last = static_cast<long long> (std::floor (static_cast<double> (start + numSamples - 1) * ratio)) + 3;
+        std::vector<Type> stretched (static_cast<size_t> (last - first));
+
+        renderStretched (input, inputLength, stretched.data(), first, static_cast<int> (last - first), static_cast<double> (stretch) * ratio);
+
+        for (auto i = 0; i < numSamples; ++i)
+        {
+            auto position = static_cast<double> (start + i) * ratio - static_cast<double> (first);
+            auto index = static_cast<size_t> (position);
+            auto t = static_cast<Type> (position - static_cast<double> (index));
+            const auto* h = stretched.data() + index - 1;
+
+            // 4-point, 3rd-order Hermite
+            auto c1 = Type (0.5) * (h[2] - h[0]);
+            auto c2 = h[0] - Type (2.5) * h[1] + Type (2) * h[2] - Type (0.5) * h[3];
+            auto c3 = Type (0.5) * (h[3] - h[0]) + Type (1.5) * (h[1] - h[2]);
+            destination[i] = ((c3 * t + c2) * t + c1) * t + h[1];
+        }
+    }
+
+    /** Overlap-adds frames centred on m * synthesisHop in the output, taken from around m * synthesisHop / ratio in the input */
+    void renderStretched (const Type* input, const int inputLength, Type* destination, const long long start, const int numSamples, const double ratio) const
+    {
+        const auto n = frameSize;
+        const auto half = n / 2;
+        // The phase vocoder can only track frequencies if both hops are a quarter frame or less, so when
+        // squashing, shrink the synthesis hop instead of letting the analysis hop grow
+        const auto synthesisHop = mode == StretchMode::PhaseVocoder ? std::max (1, static_cast<int> (n / 4 * std::min (1.0, ratio))) : n / 2;
+        const auto analysisHop = synthesisHop / ratio;
+
+        std::vector<Type> accumulated (static_cast<size_t> (numSamples), Type (0));
+        std::vector<Type> weights (static_cast<size_t> (numSamples), Type (0));
+        std::vector<Type> frame (static_cast<size_t> (n));
+
+        auto readInput = [input, inputLength] (const long long position)
+        {
+            return position >= 0 && position < inputLength ? input[position] : Type (0);
+        };
+
+        auto firstFrame = static_cast<long long> (std::floor (static_cast<double> (start - half) / synthesisHop));
+        auto lastFrame = (start + numSamples + half) / synthesisHop + 1;
+        auto warmUpFrame = firstFrame - warmUpFrames;
+
+        // Phase vocoder state
+        std::vector<std::complex<Type>> spectrum (mode == StretchMode::PhaseVocoder ? static_cast<size_t> (n) : 0);
+        std::vector<Type> previousPhases (static_cast<size_t> (half + 1), Type (0));
+        std::vector<int> framesAudible (static_cast<size_t> (half + 1), 0);
+        std::vector<double> synthesisPhases (static_cast<size_t> (half + 1), 0.0);
+        const auto settleFrames = std::max (2, static_cast<int> (std::ceil (n / analysisHop)) + 1);
+        Type previousPeak = 0;
+
+        // WSOLA state
+        const auto tolerance = n / 8;
+        long long previousStart = 0;
+
+        for (auto m = warmUpFrame; m <= lastFrame; ++m)
+        {
+            auto nominalStart = static_cast<long long> (std::llround (static_cast<double> (m) * analysisHop)) - half;
+            auto analysisStart = nominalStart;
+
+            if (mode == StretchMode::PhaseVocoder)
+            {
+                for (auto i = 0; i < n; ++i)
+                    spectrum[static_cast<size_t> (i)] = readInput (analysisStart + i) * window[static_cast<size_t> (i)];
+
+                fft.perform (spectrum.data(), false);
+
+                auto hop = static_cast<double> (analysisStart - previousStart);
+                auto quietThreshold = previousPeak * Type (1.0e-4);
+                Type peak = 0;
+
+                for (auto k = 0; k <= half; ++k)
+                {
+                    auto bin = static_cast<size_t> (k);
+                    auto magnitude = std::abs (spectrum[bin]);
+                    auto phase = std::arg (spectrum[bin]);
+                    auto binFrequency = 2.0 * pi * k / n;
+                    auto frequency = binFrequency;
+
+                    if (m != warmUpFrame && hop > 0)
+                    {
+                        // The bin's true frequency, from how far its phase moved beyond what the bin centre predicts
+                        auto deviation = phase - previousPhases[bin] - binFrequency * hop;
+                        deviation -= 2.0 * pi * std::round (deviation / (2.0 * pi));
+                        frequency += deviation / hop;
+                    }
+
+                    auto& audible = framesAudible[bin];
+                    audible = magnitude > quietThreshold ? audible + 1 : 0;
+
+                    // Once a bin's true frequency can be trusted (at the start, or once a new sound has filled the frame),
+                    // take the phase the input would have at this frame's output position.  That keeps neighbouring bins
+                    // coherent, and it doesn't depend on where rendering began, so neighbouring segments agree and
+                    // crossfade cleanly.
+                    if (audible == settleFrames || (m == warmUpFrame + 1 && audible >= 2))
+                        synthesisPhases[bin] = phase + frequency * static_cast<double> (m * synthesisHop - half - analysisStart);
+                    else
+                        synthesisPhases[bin] += frequency * synthesisHop;
+
+                    previousPhases[bin] = phase;
+                    peak = std::max (peak, magnitude);
+                    spectrum[bin] = std::polar (magnitude, static_cast<Type> (synthesisPhases[bin]));
+                }
+
+                previousPeak = peak;
+
+                for (auto k = half + 1; k < n; ++k)
+                    spectrum[static_cast<size_t> (k)] = std::conj (spectrum[static_cast<size_t> (n - k)]);
+
+                fft.perform (spectrum.data(), true);
+
+                for (auto i = 0; i < n; ++i)
+                    frame[static_cast<size_t> (i)] = spectrum[static_cast<size_t> (i)].real() * window[static_cast<size_t> (i)];
+            }
+            else
+            {
+                // Pick the start near the nominal one that best continues the last frame
+                if (m != warmUpFrame)
+                {
+                    auto natural = previousStart + synthesisHop;
+                    auto bestScore = -std::numeric_limits<double>::infinity();
+
+                    for (auto offset = -tolerance; offset <= tolerance; ++offset)
+                    {
+                        auto candidate = nominalStart + offset;
+                        double score = 0;
+
+                        for (auto i = 0; i < half; i += 2)
+                            score += static_cast<double> (readInput (candidate + i)) * static_cast<double> (readInput (natural + i));
+
+                        if (score > bestScore)
+                        {
+                            bestScore = score;
+                            analysisStart = candidate;
+                        }
+                    }
+                }
+
+                for (auto i = 0; i < n; ++i)
+                    frame[static_cast<size_t> (i)] = readInput (analysisStart + i) * window[static_cast<size_t> (i)];
+            }
+
+            previousStart = analysisStart;
+
+            if (m < firstFrame)
+                continue;
+
+            // Overlap-add into the range we're rendering
+            auto outputStart = m * synthesisHop - half - start;
+
+            for (auto i = std::max<long long> (0, -outputStart); i < n && outputStart + i < numSamples; ++i)
+            {
+                auto index = static_cast<size_t> (outputStart + i);
+                auto w = window[static_cast<size_t> (i)];
+                accumulated[index] += frame[static_cast<size_t> (i)];
+                weights[index] += mode == StretchMode::PhaseVocoder ? w * w : w;
+            }
+        }
+
+        for (auto i = 0; i < numSamples; ++i)
+            destination[i] = weights[static_cast<size_t> (i)] > Type (1.0e-6) ? accumulated[static_cast<size_t> (i)] / weights[static_cast<size_t> (i)] : Type (0);
+    }
+};
+
+// =================================================================
+
+/**
+    A real-time phase vocoder pitch shifter with a fixed latency of one frame.  Every quarter frame it analyses the
+    last frame of input, moves each bin's energy and true frequency up or down by the pitch ratio, and overlap-adds
+    the resynthesised frame into the output.
+ */
+
+template <typename Type>
+class PitchShifter : public BlockProcessor<Type>
+{
+public:
+    void setPitch (const Type semitones) noexcept
+    {
+        pitchRatio = std::pow (Type (2), semitones / Type (12));
+    }
+
+    /** Frames are 2 ^ order samples long, which is also the latency.  Call before prepare(). */
+    void setFrameOrder (const int order) noexcept
+    {
+        assert (order >= 8 && order <= 16);
+        frameOrder = order;
+    }
+
+    void prepare (const ProcessSpec& spec) override
+    {
+        fft.prepare (frameOrder);
+        frameSize = 1 << frameOrder;
+        hopSize = frameSize / 4;
+
+        window.resize (static_cast<size_t> (frameSize));
+
+        for (auto i = 0; i < frameSize; ++i)
+            window[static_cast<size_t> (i)] = static_cast<Type> (0.5 - 0.5 * std::cos (2.0 * pi * i / frameSize));
+
+        spectrum.assign (static_cast<size_t> (frameSize), {});
+        magnitudes.assign (static_cast<size_t> (frameSize / 2 + 1), Type (0));
+        frequencies.assign (static_cast<size_t> (frameSize / 2 + 1), Type (0));
+        channels.assign (static_cast<size_t> (spec.numChannels), ChannelState {});
+
+        for (auto& state : channels)
+        {
+            state.input.assign (static_cast<size_t> (frameSize), Type (0));
+            state.output.assign (static_cast<size_t> (frameSize), Type (0));
+            state.previousPhases.assign (static_cast<size_t> (frameSize / 2 + 1), Type (0));
+            state.synthesisPhases.assign (static_cast<size_t> (frameSize / 2 + 1), 0.0);
+        }
+
+        reset();
+    }
+
+    void process (AudioBlock<Type>& block) override
+    {
+        // You must call prepare() with enough channels
+        assert (block.getNumChannels() <= static_cast<int> (channels.size()));
+
+        const auto mask = frameSize - 1;
+
+        for (auto channel = 0; channel < block.getNumChannels(); ++channel)
+        {
+            auto& state = channels[static_cast<size_t> (channel)];
+            auto* data = block.getChannelPointer (channel);
+
+            for (auto sample = 0; sample < block.getNumSamples(); ++sample)
+            {
+                state.input[static_cast<size_t> (state.position)] = data[sample];
+                data[sample] = state.output[static_cast<size_t> (state.position)];
+                state.output[static_cast<size_t> (state.position)] = 0;
+                state.position = (state.position + 1) & mask;
+
+                if (++state.samplesSinceFrame == hopSize)
+                {
+                    state.samplesSinceFrame = 0;
+                    processFrame (state);
+                }
+            }
+        }
+    }
+
+    void reset() override
+    {
+        for (auto& state : channels)
+        {
+            std::fill (state.input.begin(), state.input.end(), Type (0));
+            std::fill (state.output.begin(), state.output.end(), Type (0));
+            std::fill (state.previousPhases.begin(), state.previousPhases.end(), Type (0));
+            std::fill (state.synthesisPhases.begin(), state.synthesisPhases.end(), 0.0);
+            state.position = 0;
+            state.samplesSinceFrame = 0;
+        }
+    }
+
+    int getLatencySamples() const noexcept override
+    {
+        return 1 << frameOrder;
+    }
+
+private:
+    static constexpr double pi = 3.141592653589793238;
+
+    struct ChannelState
+    {
+        std::vector<Type> input, output;
+        std::vector<Type> previousPhases;
+        std::vector<double> synthesisPhases;
+        int position = 0;
+        int samplesSinceFrame = 0;
+    };
+
+    Type pitchRatio = 1;
+    int frameOrder = 11;
+    int frameSize = 0, hopSize = 0;
+
+    FFT<Type> fft;
+    std::vector<Type> window;
+    std::vector<std::complex<Type>> spectrum;
+    std::vector<Type> magnitudes, frequencies;
+    std::vector<ChannelState> channels;
+
+    void processFrame (ChannelState& state) noexcept
+    {
+        const auto n = frameSize;
+        const auto half = n / 2;
+        const auto mask = n - 1;
+
+        // state.position is now the oldest input sample
+        for (auto i = 0; i < n; ++i)
+            spectrum[static_cast<size_t> (i)] = state.input[static_cast<size_t> ((state.position + i) & mask)] * window[static_cast<size_t> (i)];
+
+        fft.perform (spectrum.data(), false);
+
+        std::fill (magnitudes.begin(), magnitudes.end(), Type (0));
+        std::fill (frequencies.begin(), frequencies.end(), Type (0));
+
+        for (auto k = 0; k <= half; ++k)
+        {
+            auto bin = static_cast<size_t> (k);
+            auto phase = std::arg (spectrum[bin]);
+            auto binFrequency = 2.0 * pi * k / n;
+
+            auto deviation = phase - state.previousPhases[bin] - binFrequency * hopSize;
+            deviation -= 2.0 * pi * std::round (deviation / (2.0 * pi));
+            state.previousPhases[bin] = phase;
+
+            // Move the bin to where its shifted frequency lands
+            auto target = static_cast<int> (std::lround (k * pitchRatio));
+
+            if (target <= half)
+            {
+                magnitudes[static_cast<size_t> (target)] += std::abs (spectrum[bin]);
+                frequencies[static_cast<size_t> (target)] = static_cast<Type> ((binFrequency + deviation / hopSize) * pitchRatio);
+            }
+        }
+
+        for (auto k = 0; k <= half; ++k)
+        {
+            auto bin = static_cast<size_t> (k);
+            state.synthesisPhases[bin] += static_cast<double> (frequencies[bin]) * hopSize;
+            spectrum[bin] = std::polar (magnitudes[bin], static_cast<Type> (state.synthesisPhases[bin]));
+        }
+
+        for (auto k = half + 1; k < n; ++k)
+            spectrum[static_cast<size_t> (k)] = std::conj (spectrum[static_cast<size_t> (n - k)]);
+
+        fft.perform (spectrum.data(), true);
+
+        // Squared Hann windows at a quarter frame hop add up to 1.5
+        const auto gain = Type (2) / Type (3);
+
+        for (auto i = 0; i < n; ++i)
+            state.output[static_cast<size_t> ((state.position + i) & mask)] += spectrum[static_cast<size_t> (i)].real() * window[static_cast<size_t> (i)] * gain;
+    }
+};
+
 } // namespace tap
 
 #endif /* DspHelpers_hpp */
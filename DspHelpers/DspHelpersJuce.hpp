@@ -0,0 +1,199 @@
+//
+//  DspHelpersJuce.hpp
+//  DspHelpers
+//
+//  Copyright © 2020 The Audio Programmer. All rights reserved.
+//
+
+#ifndef DspHelpersJuce_hpp
+#define DspHelpersJuce_hpp
+
+#include "DspHelpers.hpp"
+#include <juce_dsp/juce_dsp.h>
+
+// Optional glue for running tap processors directly on JUCE buffers.  DspHelpers.hpp itself stays dependency free,
+// so only include this header in projects that already use the juce_dsp module.
+
+namespace tap
+{
+
+/** Wraps a juce::dsp::AudioBlock as a tap::AudioBlock.  Nothing is copied, the tap block points at the same samples. */
+template <typename Type>
+AudioBlock<Type> makeAudioBlock (const juce::dsp::AudioBlock<Type>& block) noexcept
+{
+    // Too many channels for a tap::AudioBlock!
+    jassert (block.getNumChannels() <= static_cast<size_t> (AudioBlock<Type>::maxChannels));
+
+    Type* channels[AudioBlock<Type>::maxChannels];
+    auto numChannels = static_cast<int> (block.getNumChannels());
+
+    for (auto channel = 0; channel < numChannels; ++channel)
+        channels[channel] = block.getChannelPointer (static_cast<size_t> (channel));
+
+    return AudioBlock<Type> (channels, numChannels, static_cast<int> (block.getNumSamples()));
+}
+
+/** Wraps a range of a juce::AudioBuffer as a tap::AudioBlock without copying */
+template <typename Type>
+AudioBlock<Type> makeAudioBlock (juce::AudioBuffer<Type>& buffer, const int startSample, const int numSamples) noexcept
+{
+    return makeAudioBlock (juce::dsp::AudioBlock<Type> (buffer).getSubBlock (static_cast<size_t> (startSample),
+                                                                           static_cast<size_t> (numSamples)));
+}
+
+/** Wraps the active region of an AudioSourceChannelInfo, like the one getNextAudioBlock() receives */
+inline AudioBlock<float> makeAudioBlock (const juce::AudioSourceChannelInfo& bufferToFill) noexcept
+{
+    return makeAudioBlock (*bufferToFill.buffer, bufferToFill.startSample, bufferToFill.numSamples);
+}
+
+/** Runs a tap::BlockProcessor on a JUCE process context, handling bypass and separate input and output blocks */
+template <typename Type, typename ContextType>
+void processContext (BlockProcessor<Type>& processor, const ContextType& context)
+{
+    auto&& outputBlock = context.getOutputBlock();
+
+    if (context.usesSeparateInputAndOutputBlocks())
+        outputBlock.copyFrom (context.getInputBlock());
+
+    if (context.isBypassed)
+        return;
+
+    auto block = makeAudioBlock (outputBlock);
+    processor.process (block);
+}
+
+// =================================================================
+
+/**
+    Exposes any tap::BlockProcessor as a juce::dsp::ProcessorBase, so it can be used anywhere JUCE
+    expects one, including inside a juce::dsp::ProcessorChain.
+ */
+
+template <typename ProcessorType>
+class JuceProcessor : public juce::dsp::ProcessorBase
+{
+public:
+    /** Access the wrapped processor, e.g. to set its parameters */
+    ProcessorType& get() noexcept
+    {
+        return processor;
+    }
+
+    void prepare (const juce::dsp::ProcessSpec& spec) override
+    {
+        ProcessSpec tapSpec;
+        tapSpec.sampleRate = spec.sampleRate;
+        tapSpec.maximumBlockSize = static_cast<int> (spec.maximumBlockSize);
+        tapSpec.numChannels = static_cast<int> (spec.numChannels);
+        processor.prepare (tapSpec);
+    }
+
+    void process (const juce::dsp::ProcessContextReplacing<float>& context) override
+    {
+        processContext (processor, context);
+    }
+
+    void reset() override
+    {
+        processor.reset();
+    }
+
+    int getLatencySamples() const noexcept
+    {
+        return processor.getLatencySamples();
+    }
+
+private:
+    ProcessorType processor;
+};
+
+// =================================================================
+
+/**
+    Exposes one of the sample-by-sample tap classes (SynthWave, Tremolo, Distortion...) as a
+    juce::dsp::ProcessorBase.  It keeps one instance per channel, just like MainComponent does, and
+    calls KernelType for every sample.  KernelType is a small function object, for example:
+
+        struct BitCrush
+        {
+            float operator() (tap::Distortion<float>& distortion, float sample) const
+            {
+                return distortion.processBitCrush (sample, 4.0f);
+            }
+        };
+
+        juce::dsp::ProcessorChain<tap::PerChannelProcessor<tap::Distortion<float>, BitCrush>> chain;
+ */
+
+template <typename ProcessorType, typename KernelType>
+class PerChannelProcessor : public juce::dsp::ProcessorBase
+{
+public:
+    /** Access the instance used for a channel, e.g. to set its parameters */
+    ProcessorType& get (const int channel) noexcept
+    {
+        return processors[static_cast<size_t> (channel)];
+    }
+
+    KernelType& getKernel() noexcept
+    {
+        return kernel;
+    }
+
+    void prepare (const juce::dsp::ProcessSpec& spec) override
+    {
+        processors.resize (spec.numChannels);
+        auto sampleRate = spec.sampleRate;
+
+        for (auto& processor : processors)
+            prepareIfNeeded (processor, sampleRate, 0);
+    }
+
+    void process (const juce::dsp::ProcessContextReplacing<float>& context) override
+    {
+        auto&& outputBlock = context.getOutputBlock();
+
+        if (context.usesSeparateInputAndOutputBlocks())
+            outputBlock.copyFrom (context.getInputBlock());
+
+        if (context.isBypassed)
+            return;
+
+        auto numChannels = std::min (outputBlock.getNumChannels(), processors.size());
+        auto numSamples = outputBlock.getNumSamples();
+
+        for (size_t channel = 0; channel < numChannels; ++channel)
+        {
+            auto* data = outputBlock.getChannelPointer (channel);
+            auto& processor = processors[channel];
+
+            for (size_t sample = 0; sample < numSamples; ++sample)
+                data[sample] = kernel (processor, data[sample]);
+        }
+    }
+
+    void reset() override
+    {
+    }
+
+private:
+    std::vector<ProcessorType> processors;
+    KernelType kernel;
+
+    // Only SynthWave and Tremolo need a sample rate, so only call prepareToPlay on classes that have one
+    template <typename Processor>
+    static auto prepareIfNeeded (Processor& processor, double& sampleRate, int) -> decltype (processor.prepareToPlay (sampleRate), void())
+    {
+        processor.prepareToPlay (sampleRate);
+    }
+
+    template <typename Processor>
+    static void prepareIfNeeded (Processor&, double&, long)
+    {
+    }
+};
+
+} // namespace tap
+
+#endif /* DspHelpersJuce_hpp */